@@ -4,13 +4,96 @@
 
 #include <mono/mini/mini.h>
 #include <mono/metadata/assembly.h>
+#include <mono/utils/mono-logger-internals.h>
 #include <locale.h>
+#include <string.h>
 
 void mono_wasm_aot_init(void);
 
+// Startup timeline. The phases of the boot are timed with a clock that
+// index.js provides (milliseconds, from performance.now()), and read from
+// there (see MonoTimeline()).
+double mono_wasm_clock_now(void);
+
+#define PHASES_MAX 16
+
+static struct {
+    const char *name;
+    double start;
+    double end;
+} phases[PHASES_MAX];
+static int phases_count = 0;
+
+static int
+phase_begin(const char *name)
+{
+    if (phases_count == PHASES_MAX) {
+        return -1;
+    }
+    int i = phases_count++;
+    phases[i].name = name;
+    phases[i].start = mono_wasm_clock_now();
+    phases[i].end = -1; // until it ends, if it does (see exit())
+    return i;
+}
+
+static void
+phase_end(int i)
+{
+    if (i >= 0) {
+        phases[i].end = mono_wasm_clock_now();
+    }
+}
+
 __attribute__ ((__visibility__ ("default")))
 int
-mono_wasm_main(char *main_assembly_name, int debug)
+mono_wasm_phases_count(void)
+{
+    return phases_count;
+}
+
+__attribute__ ((__visibility__ ("default")))
+const char *
+mono_wasm_phase_name(int i)
+{
+    return i >= 0 && i < phases_count ? phases[i].name : NULL;
+}
+
+__attribute__ ((__visibility__ ("default")))
+double
+mono_wasm_phase_start(int i)
+{
+    return i >= 0 && i < phases_count ? phases[i].start : 0;
+}
+
+__attribute__ ((__visibility__ ("default")))
+double
+mono_wasm_phase_end(int i)
+{
+    return i >= 0 && i < phases_count ? phases[i].end : 0;
+}
+
+// Called once index.js has read the phases.
+__attribute__ ((__visibility__ ("default")))
+void
+mono_wasm_phases_clear(void)
+{
+    phases_count = 0;
+}
+
+static MonoDomain *main_domain = NULL;
+static MonoAssembly *main_assembly = NULL;
+static char *main_assembly_path = NULL;
+
+// Boots the runtime and opens the main assembly, up to running Main() (see
+// mono_wasm_run()). index.js can snapshot the memory once this returns, at
+// build time, and restore it instead of calling this function. What is done
+// here is then frozen as it was on the build machine: the environment
+// variables set below, and the values the runtime read from the clock (e.g.
+// its start time). The log level is set again by mono_wasm_run().
+__attribute__ ((__visibility__ ("default")))
+void
+mono_wasm_boot(char *main_assembly_name, int debug)
 {
     g_log("mono-wasm", G_LOG_LEVEL_INFO, "booting main()");
 
@@ -25,19 +108,116 @@ mono_wasm_main(char *main_assembly_name, int debug)
 
     g_set_prgname("hello");
 
+    int phase = phase_begin("aot init");
     mono_wasm_aot_init();
+    phase_end(phase);
 
     g_log("mono-wasm", G_LOG_LEVEL_INFO, "initializing mono runtime");
+    phase = phase_begin("jit init");
     mono_jit_set_aot_mode(MONO_AOT_MODE_LLVMONLY);
-    MonoDomain *domain = mono_jit_init_version("hello", "v4.0.30319");
+    main_domain = mono_jit_init_version("hello", "v4.0.30319");
+    phase_end(phase);
 
     g_log("mono-wasm", G_LOG_LEVEL_INFO, "opening main assembly `%s'",
             main_assembly_name);
-    MonoAssembly *assembly = mono_assembly_open(main_assembly_name, NULL);
-    g_assert(assembly != NULL);
+    phase = phase_begin("assembly open");
+    main_assembly = mono_assembly_open(main_assembly_name, NULL);
+    phase_end(phase);
+    g_assert(main_assembly != NULL);
+    main_assembly_path = g_strdup(main_assembly_name);
+}
+
+// Runs Main(), once mono_wasm_boot() was called (or its state restored).
+__attribute__ ((__visibility__ ("default")))
+int
+mono_wasm_run(int debug)
+{
+    g_assert(main_assembly != NULL);
+
+    // Not the one of the build, if the state comes from a snapshot.
+    const char *log_level = debug ? "debug" : "error";
+    g_setenv("MONO_LOG_LEVEL", log_level, 1);
+    mono_trace_set_level_string(log_level);
 
     g_log("mono-wasm", G_LOG_LEVEL_INFO, "running Main()");
     int mono_argc = 1;
-    char *mono_argv[] = { main_assembly_name, NULL };
-    return mono_jit_exec(domain, assembly, mono_argc, mono_argv);
+    char *mono_argv[] = { main_assembly_path, NULL };
+    int phase = phase_begin("main");
+    int ret = mono_jit_exec(main_domain, main_assembly, mono_argc, mono_argv);
+    phase_end(phase);
+    return ret;
+}
+
+__attribute__ ((__visibility__ ("default")))
+int
+mono_wasm_main(char *main_assembly_name, int debug)
+{
+    mono_wasm_boot(main_assembly_name, debug);
+    return mono_wasm_run(debug);
+}
+
+// Returns the MONO_TYPE_* code that the JS/Mono API (see MonoInvoker() in
+// index.js) uses to marshal a value of `type': enums are reduced to their
+// underlying type and all reference types (besides strings) are objects.
+static int
+mono_wasm_type_code(MonoType *type)
+{
+    if (mono_type_is_byref(type)) {
+        return MONO_TYPE_BYREF;
+    }
+    int code = mono_type_get_type(mono_type_get_underlying_type(type));
+    if (code != MONO_TYPE_STRING && mono_type_is_reference(type)) {
+        return MONO_TYPE_OBJECT;
+    }
+    return code;
+}
+
+// Writes the type code of the return value then of each parameter of
+// `method' in `types' (up to `max' of them), and returns the number of
+// parameters, or -1 if the signature can't be loaded.
+__attribute__ ((__visibility__ ("default")))
+int
+mono_wasm_method_get_types(MonoMethod *method, int *types, int max)
+{
+    MonoMethodSignature *sig = mono_method_signature(method);
+    if (sig == NULL) {
+        return -1;
+    }
+
+    if (max > 0) {
+        types[0] = mono_wasm_type_code(mono_signature_get_return_type(sig));
+    }
+    gpointer iter = NULL;
+    MonoType *type;
+    int i = 1;
+    while ((type = mono_signature_get_params(sig, &iter)) != NULL) {
+        if (i < max) {
+            types[i] = mono_wasm_type_code(type);
+        }
+        i++;
+    }
+
+    return mono_signature_get_param_count(sig);
+}
+
+// Looks up the `count' methods of `klass' whose names are stored one after
+// the other (each NUL-terminated) in `names', with the corresponding `flags'
+// (see mono_class_get_method_from_name_flags()), and sets them (or NULL) in
+// `methods'. Returns the number of methods found. Used by MonoMethods() in
+// index.js to resolve many methods in a single call.
+__attribute__ ((__visibility__ ("default")))
+int
+mono_wasm_class_get_methods(MonoClass *klass, const char *names,
+        const int *flags, int count, MonoMethod **methods)
+{
+    int found = 0;
+    for (int i = 0; i < count; i++) {
+        methods[i] = mono_class_get_method_from_name_flags(klass, names, -1,
+                flags[i]);
+        if (methods[i] != NULL) {
+            found++;
+        }
+        names += strlen(names) + 1;
+    }
+    return found;
 }
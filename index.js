@@ -16,93 +16,149 @@ var heap_size;
 
 var browser_environment = (typeof window != "undefined");
 
+// Views over the WASM memory, which must be re-created (by heap_update())
+// whenever the memory grows, as its previous buffer then becomes detached.
+// Values are little-endian, unaligned ones go through the DataView.
+var heap_u16;
+var heap_i32;
+var heap_view;
+
+function heap_update() {
+  var buffer = instance.exports.memory.buffer;
+  heap = new Uint8Array(buffer);
+  heap_u16 = new Uint16Array(buffer);
+  heap_i32 = new Int32Array(buffer);
+  heap_view = new DataView(buffer);
+  heap_size = buffer.byteLength;
+}
+
 function heap_get_short(ptr) {
-  var d = 0;
-  d += (heap[ptr + 0] << 0);
-  d += (heap[ptr + 1] << 8);
-  return d;
+  return (ptr & 1) ? heap_view.getUint16(ptr, true) : heap_u16[ptr >> 1];
 }
 
 function heap_get_int(ptr) {
-  var d = 0;
-  d += (heap[ptr + 0] << 0);
-  d += (heap[ptr + 1] << 8);
-  d += (heap[ptr + 2] << 16);
-  d += (heap[ptr + 3] << 24);
-  return d;
+  return (ptr & 3) ? heap_view.getInt32(ptr, true) : heap_i32[ptr >> 2];
 }
 
+// 64-bit values are returned as numbers while they are exact (within 2^53),
+// and as BigInts past that where the JS engine has them.
 function heap_get_long(ptr) {
-  var d = 0;
-  d += (heap[ptr + 0] << 0);
-  d += (heap[ptr + 1] << 8);
-  d += (heap[ptr + 2] << 16);
-  d += (heap[ptr + 3] << 24);
-  d += (heap[ptr + 4] << 32);
-  d += (heap[ptr + 5] << 40);
-  d += (heap[ptr + 6] << 48);
-  d += (heap[ptr + 7] << 56);
-  return d;
+  var hi = heap_view.getInt32(ptr + 4, true);
+  if ((hi < -0x200000 || hi >= 0x200000) && heap_view.getBigInt64) {
+    return heap_view.getBigInt64(ptr, true);
+  }
+  return heap_view.getUint32(ptr, true) + hi * 4294967296;
+}
+
+function heap_get_ulong(ptr) {
+  var hi = heap_view.getUint32(ptr + 4, true);
+  if (hi >= 0x200000 && heap_view.getBigUint64) {
+    return heap_view.getBigUint64(ptr, true);
+  }
+  return heap_view.getUint32(ptr, true) + hi * 4294967296;
 }
 
 function heap_set_int(ptr, d) {
-  heap[ptr + 0] = ((d & 0x000000ff) >> 0);
-  heap[ptr + 1] = ((d & 0x0000ff00) >> 8);
-  heap[ptr + 2] = ((d & 0x00ff0000) >> 16);
-  heap[ptr + 3] = ((d & 0xff000000) >> 24);
+  if (ptr & 3) {
+    heap_view.setInt32(ptr, d, true);
+  }
+  else {
+    heap_i32[ptr >> 2] = d;
+  }
   return d;
 }
 
+// Takes a number or a BigInt (stored modulo 2^64, so for signed and unsigned
+// values alike).
 function heap_set_long(ptr, d) {
-  heap[ptr + 0] = ((d & 0x00000000000000ff) >> 0);
-  heap[ptr + 1] = ((d & 0x000000000000ff00) >> 8);
-  heap[ptr + 2] = ((d & 0x0000000000ff0000) >> 16);
-  heap[ptr + 3] = ((d & 0x00000000ff000000) >> 24);
-  heap[ptr + 4] = ((d & 0x000000ff00000000) >> 32);
-  heap[ptr + 5] = ((d & 0x0000ff0000000000) >> 40);
-  heap[ptr + 6] = ((d & 0x00ff000000000000) >> 48);
-  heap[ptr + 7] = ((d & 0xff00000000000000) >> 56);
+  if (typeof d == "bigint") {
+    heap_view.setBigUint64(ptr, BigInt.asUintN(64, d), true);
+    return d;
+  }
+  var hi = Math.floor(d / 4294967296);
+  heap_view.setUint32(ptr, d - (hi * 4294967296), true);
+  heap_view.setInt32(ptr + 4, hi, true);
   return d;
 }
 
-function heap_get_string(ptr, len=-1) {
+// C strings are UTF-8 and MonoString characters UTF-16. The JS shells don't
+// all provide TextDecoder and TextEncoder, hence the (slower) fallbacks.
+var utf8_decoder = undefined;
+var utf16_decoder = undefined;
+var utf8_encoder = undefined;
+if (typeof TextDecoder != "undefined") {
+  utf8_decoder = new TextDecoder('utf-8');
+  utf16_decoder = new TextDecoder('utf-16le');
+}
+if (typeof TextEncoder != "undefined") {
+  utf8_encoder = new TextEncoder();
+}
+
+function string_from_char_codes(codes) {
   var str = '';
-  var i = 0;
-  while (true) {
-    var c = heap[ptr + i];
-    if (c == 0) {
-      break;
-    }
-    if (i == len) {
-      break;
-    }
-    str += String.fromCharCode(c);
-    i++;
+  // In chunks, as apply() has a limit on the number of arguments.
+  for (var i = 0; i < codes.length; i += 8192) {
+    str += String.fromCharCode.apply(null, codes.subarray(i, i + 8192));
   }
   return str;
 }
 
+// The decoder is shared, so it never keeps the end of a partial sequence for
+// the next call (the output fds have their own, see out_buffer_add()).
+function utf8_decode(bytes) {
+  if (utf8_decoder) {
+    return utf8_decoder.decode(bytes);
+  }
+  var str = string_from_char_codes(bytes);
+  try {
+    return decodeURIComponent(escape(str));
+  }
+  catch (e) {
+    return str; // not valid UTF-8
+  }
+}
+
+function heap_get_string(ptr, len=-1) {
+  var bytes = heap.subarray(ptr, len >= 0 ? ptr + len : heap_size);
+  var end = bytes.indexOf(0);
+  if (end != -1) {
+    bytes = bytes.subarray(0, end);
+  }
+  return utf8_decode(bytes);
+}
+
 function heap_get_mono_string(ptr)
 {
   var str_length = heap_get_int(ptr + 8)
   var str_chars = ptr + 12
-  var str = ''
-  for (var i = 0; i < str_length; i++) {
-    var c = heap_get_short(str_chars + (i * 2))
-    str += String.fromCharCode(c);
+  if (utf16_decoder) {
+    return utf16_decoder.decode(heap.subarray(str_chars,
+                str_chars + (str_length * 2)));
   }
-  return str;
+  return string_from_char_codes(heap_u16.subarray(str_chars >> 1,
+              (str_chars >> 1) + str_length));
 }
 
+// Writes `str' as a NUL-terminated UTF-8 string, which can take up to 3 bytes
+// per UTF-16 code unit, and returns its length.
 function heap_set_string(ptr, str) {
-  for (var i = 0; i < str.length; i++) {
-    heap[ptr + i] = str.charCodeAt(i);
+  var len = 0;
+  if (utf8_encoder) {
+    len = utf8_encoder.encodeInto(str, heap.subarray(ptr, heap_size - 1))
+      .written;
+  }
+  else {
+    var bytes = unescape(encodeURIComponent(str));
+    for (len = 0; len < bytes.length; len++) {
+      heap[ptr + len] = bytes.charCodeAt(len);
+    }
   }
-  heap[ptr + str.length] = 0
+  heap[ptr + len] = 0
+  return len
 }
 
 function heap_malloc_string(str) {
-  var ptr = instance.exports.malloc(str.length + 1)
+  var ptr = instance.exports.malloc((str.length * 3) + 1)
   heap_set_string(ptr, str)
   return ptr
 }
@@ -124,13 +180,17 @@ function log(str) {
   browser_environment ? console.log(str) : print(str)
 }
 
+// The complete lines of pending program output are flushed first, to keep the
+// messages in order without cutting lines.
 function debug(str) {
   if (debug_logs) {
+    out_flush_all(false);
     log(">> " + str);
   }
 }
 
 function error(str) {
+  out_flush_all(true);
   log("!! " + str + ": " + new Error().stack);
 }
 
@@ -147,15 +207,120 @@ function NotYetImplementedException(what) {
 }
 
 // TODO: these missing (imported) functions shouldn't be called from the runtime.
-var missing_functions=["__addtf3","__clone","__divdc3","__divtf3","__eqtf2","__extenddftf2","__extendsftf2","__fixtfdi","__fixtfsi","__fixunstfsi","__floatsitf","__floatunsitf","__getf2","__lsysinfo","__lttf2","__mmap","__multf3","__munmap","__netf2","__randname","__set_thread_area","__subtf3","__synccall","__syscall","__syscall0","__syscall1","__syscall2","__syscall3","__syscall4","__syscall5","__syscall6","__syscall_cp","__trunctfdf2","__trunctfsf2","__unordtf2","__wait","_pthread_cleanup_pop","_pthread_cleanup_push","accept","bind","btowc","cabs","chmod","closedir","closelog","connect","execv","execve","execvp","feclearexcept","fegetround","feraiseexcept","fesetround","fetestexcept","fork","freeaddrinfo","getaddrinfo","getgrgid_r","getgrnam_r","getnameinfo","getpeername","getpriority","getprotobyname","getpwnam_r","getpwuid_r","getrusage","getsockname","getsockopt","htons","ioctl","listen","longjmp","lstat","mbrtowc","mbsinit","mbsnrtowcs","mbstowcs","mbtowc","mincore","mkdir","mkdtemp","mkstemp","mmap","mono_arch_cleanup","mono_arch_context_get_int_reg","mono_arch_create_generic_trampoline","mono_arch_create_rgctx_lazy_fetch_trampoline","mono_arch_create_specific_trampoline","mono_arch_find_imt_method","mono_arch_find_static_call_vtable","mono_arch_flush_register_windows","mono_arch_free_jit_tls_data","mono_arch_get_argument_info","mono_arch_get_call_filter","mono_arch_get_delegate_invoke_impl","mono_arch_get_delegate_virtual_invoke_impl","mono_arch_get_gsharedvt_arg_trampoline","mono_arch_get_gsharedvt_call_info","mono_arch_get_gsharedvt_trampoline","mono_arch_get_restore_context","mono_arch_get_rethrow_exception","mono_arch_get_static_rgctx_trampoline","mono_arch_get_this_arg_from_call","mono_arch_get_throw_corlib_exception","mono_arch_get_throw_exception","mono_arch_get_unbox_trampoline","mono_arch_handle_exception","mono_arch_ip_from_context","mono_arch_patch_callsite","mono_arch_patch_plt_entry","mono_arch_regname","mono_arch_unwind_frame","mono_interp_frame_iter_init","mono_interp_frame_iter_next","mono_interp_run_finally","mono_interp_set_resume_state","mono_monoctx_to_sigctx","mono_mprotect","mono_sigctx_to_monoctx","mono_vfree","mono_w32file_get_volume_information","mono_wasm_js_eval_imp","mono_wasm_throw_exception","msync","munmap","opendir","openlog","posix_spawn","posix_spawn_file_actions_adddup2","posix_spawn_file_actions_destroy","posix_spawn_file_actions_init","pthread_attr_destroy","pthread_attr_getstacksize","pthread_attr_init","pthread_attr_setdetachstate","pthread_attr_setstacksize","pthread_barrier_init","pthread_barrier_wait","pthread_cond_broadcast","pthread_cond_destroy","pthread_cond_init","pthread_cond_signal","pthread_cond_timedwait","pthread_cond_wait","pthread_condattr_destroy","pthread_condattr_init","pthread_condattr_setclock","pthread_create","pthread_exit","pthread_getschedparam","pthread_getspecific","pthread_join","pthread_key_create","pthread_key_delete","pthread_kill","pthread_mutex_destroy","pthread_mutex_init","pthread_mutex_lock","pthread_mutex_trylock","pthread_mutex_unlock","pthread_mutexattr_destroy","pthread_mutexattr_init","pthread_mutexattr_settype","pthread_once","pthread_self","pthread_setcancelstate","pthread_setschedparam","pthread_setspecific","pthread_sigmask","readdir","recvfrom","recvmsg","sched_get_priority_max","sched_yield","select","sem_destroy","sem_init","sem_post","sem_timedwait","sem_trywait","sem_wait","send","sendmsg","sendto","setjmp","setpriority","setsockopt","shutdown","socket","statvfs","syslog","uname","utimensat","waitpid","wcsrtombs","wctomb","mono_arch_build_imt_trampoline"];
+var missing_functions=["__addtf3","__clone","__divdc3","__divtf3","__eqtf2","__extenddftf2","__extendsftf2","__fixtfdi","__fixtfsi","__fixunstfsi","__floatsitf","__floatunsitf","__getf2","__lsysinfo","__lttf2","__multf3","__netf2","__randname","__set_thread_area","__subtf3","__synccall","__syscall","__syscall0","__syscall1","__syscall2","__syscall3","__syscall4","__syscall5","__syscall6","__syscall_cp","__trunctfdf2","__trunctfsf2","__unordtf2","__wait","_pthread_cleanup_pop","_pthread_cleanup_push","accept","bind","btowc","cabs","chmod","closedir","closelog","connect","execv","execve","execvp","feclearexcept","fegetround","feraiseexcept","fesetround","fetestexcept","fork","freeaddrinfo","getaddrinfo","getgrgid_r","getgrnam_r","getnameinfo","getpeername","getpriority","getprotobyname","getpwnam_r","getpwuid_r","getrusage","getsockname","getsockopt","htons","ioctl","listen","longjmp","lstat","mbrtowc","mbsinit","mbsnrtowcs","mbstowcs","mbtowc","mincore","mkdir","mkdtemp","mkstemp","mono_arch_cleanup","mono_arch_context_get_int_reg","mono_arch_create_generic_trampoline","mono_arch_create_rgctx_lazy_fetch_trampoline","mono_arch_create_specific_trampoline","mono_arch_find_imt_method","mono_arch_find_static_call_vtable","mono_arch_flush_register_windows","mono_arch_free_jit_tls_data","mono_arch_get_argument_info","mono_arch_get_call_filter","mono_arch_get_delegate_invoke_impl","mono_arch_get_delegate_virtual_invoke_impl","mono_arch_get_gsharedvt_arg_trampoline","mono_arch_get_gsharedvt_call_info","mono_arch_get_gsharedvt_trampoline","mono_arch_get_restore_context","mono_arch_get_rethrow_exception","mono_arch_get_static_rgctx_trampoline","mono_arch_get_this_arg_from_call","mono_arch_get_throw_corlib_exception","mono_arch_get_throw_exception","mono_arch_get_unbox_trampoline","mono_arch_handle_exception","mono_arch_ip_from_context","mono_arch_patch_callsite","mono_arch_patch_plt_entry","mono_arch_regname","mono_arch_unwind_frame","mono_interp_frame_iter_init","mono_interp_frame_iter_next","mono_interp_run_finally","mono_interp_set_resume_state","mono_monoctx_to_sigctx","mono_mprotect","mono_sigctx_to_monoctx","mono_vfree","mono_w32file_get_volume_information","mono_wasm_js_eval_imp","mono_wasm_throw_exception","msync","opendir","openlog","posix_spawn","posix_spawn_file_actions_adddup2","posix_spawn_file_actions_destroy","posix_spawn_file_actions_init","pthread_attr_destroy","pthread_attr_getstacksize","pthread_attr_init","pthread_attr_setdetachstate","pthread_attr_setstacksize","pthread_barrier_init","pthread_barrier_wait","pthread_cond_broadcast","pthread_cond_destroy","pthread_cond_init","pthread_cond_signal","pthread_cond_timedwait","pthread_cond_wait","pthread_condattr_destroy","pthread_condattr_init","pthread_condattr_setclock","pthread_create","pthread_exit","pthread_getschedparam","pthread_getspecific","pthread_join","pthread_key_create","pthread_key_delete","pthread_kill","pthread_mutex_destroy","pthread_mutex_init","pthread_mutex_lock","pthread_mutex_trylock","pthread_mutex_unlock","pthread_mutexattr_destroy","pthread_mutexattr_init","pthread_mutexattr_settype","pthread_once","pthread_self","pthread_setcancelstate","pthread_setschedparam","pthread_setspecific","pthread_sigmask","readdir","recvfrom","recvmsg","sched_get_priority_max","sched_yield","select","sem_destroy","sem_init","sem_post","sem_timedwait","sem_trywait","sem_wait","send","sendmsg","sendto","setjmp","setpriority","setsockopt","shutdown","socket","statvfs","syslog","uname","utimensat","waitpid","wcsrtombs","wctomb","mono_arch_build_imt_trampoline"];
 // TODO: these missing (imported) globals should also be removed from the runtime.
 var missing_globals=["_ZTIPi"];
 
 // variables generated by `mono-wasm':
 //   files: an array of IL assemblies files
+//   files_manifest: maps each file to its { size, hash, eager } (eager files
+//     are loaded before running Main(), the others are downloaded in the
+//     background meanwhile, and loaded when first opened)
+//   files_hash: a hash of index.wasm and of the files
+//   snapshot_file: the memory snapshot to restore instead of booting the
+//     runtime, if `mono-wasm --snapshot' made one (see snapshot_save())
 if (typeof files == "undefined") {
   var files = [];
 }
+if (typeof files_manifest == "undefined") {
+  var files_manifest = {};
+}
+if (typeof files_hash == "undefined") {
+  var files_hash = undefined;
+}
+if (typeof snapshot_file == "undefined") {
+  var snapshot_file = undefined;
+}
+
+// variables the page can set before loading index.js:
+//   mono_wasm_cache: true to keep the compiled code and the files in
+//     IndexedDB between visits, or a storage object (see cache_open())
+//   mono_wasm_output: a function receiving (fd, text) what the program
+//     writes on stdout and stderr, instead of the console
+//   mono_wasm_memory: { initial, maximum, growth } memory sizes (in bytes)
+//     and growth factor, see memory_config
+//   mono_wasm_timing: true to also report the startup phases (see
+//     MonoTimeline()) as User Timing measures, for the browser profiler
+if (typeof mono_wasm_cache == "undefined") {
+  var mono_wasm_cache = false;
+}
+if (typeof mono_wasm_output == "undefined") {
+  var mono_wasm_output = undefined;
+}
+if (typeof mono_wasm_timing == "undefined") {
+  var mono_wasm_timing = false;
+}
+
+// Startup timeline. Phases are { name, start, end } times in milliseconds
+// since the page started loading, timed by index.js (downloads, compilation,
+// ...) and by boot.c with the same clock (the boot steps and Main()).
+var timeline_phases = []
+
+function clock_now() {
+  return typeof performance != "undefined" ? performance.now() : Date.now()
+}
+
+functions['env']['mono_wasm_clock_now'] = clock_now
+
+function timeline_add(name, start, end) {
+  timeline_phases.push({ name: name, start: start, end: end })
+  if (mono_wasm_timing && typeof performance != "undefined"
+      && performance.measure) {
+    try {
+      performance.measure('mono-wasm: ' + name, { start: start, end: end })
+    }
+    catch (e) {
+      // Older browsers only measure between marks.
+    }
+  }
+}
+
+// Times `f', which can return a promise.
+function timeline_phase(name, f) {
+  var start = clock_now()
+  var ret = undefined
+  try {
+    ret = f()
+  }
+  catch (e) {
+    timeline_add(name, start, clock_now())
+    throw e
+  }
+  if (ret && typeof ret.then == "function") {
+    return ret.then(function(value) {
+      timeline_add(name, start, clock_now())
+      return value
+    }, function(e) {
+      timeline_add(name, start, clock_now())
+      throw e
+    })
+  }
+  timeline_add(name, start, clock_now())
+  return ret
+}
+
+// Moves the phases boot.c timed into the timeline. Phases that didn't end
+// (e.g. Main() calling exit()) end now.
+function timeline_runtime_read() {
+  var exports = instance.exports
+  var count = exports.mono_wasm_phases_count()
+  for (var i = 0; i < count; i++) {
+    var end = exports.mono_wasm_phase_end(i)
+    timeline_add(heap_get_string(exports.mono_wasm_phase_name(i)),
+            exports.mono_wasm_phase_start(i), end < 0 ? clock_now() : end)
+  }
+  exports.mono_wasm_phases_clear()
+}
+
+// Returns the startup phases, sorted by start time, with their duration.
+function MonoTimeline() {
+  return timeline_phases.map(function(phase) {
+    return { name: phase.name, start: phase.start, end: phase.end,
+      duration: phase.end - phase.start }
+  }).sort(function(a, b) {
+    return a.start - b.start
+  })
+}
 
 for (var i in missing_functions) {
   f = missing_functions[i];
@@ -167,7 +332,7 @@ for (var i in missing_functions) {
   })(f);
 }
 
-var do_nothing_functions = ['pthread_mutexattr_init', 'pthread_mutexattr_settype', 'pthread_mutex_init', 'pthread_mutexattr_destroy', 'pthread_mutex_lock', 'pthread_mutex_unlock', 'pthread_condattr_init', 'pthread_condattr_setclock', 'pthread_cond_init', 'pthread_condattr_destroy', 'pthread_sigmask', '_pthread_cleanup_push', '_pthread_cleanup_pop', 'pthread_self', 'pthread_create', 'pthread_mutex_trylock', 'pthread_attr_init', 'pthread_attr_setstacksize', 'pthread_attr_getstacksize', 'pthread_attr_destroy', 'sem_init', 'sem_wait', 'sem_post', 'mono_console_init', '__munmap', 'pthread_cond_broadcast', 'pthread_mutex_destroy', 'pthread_cond_destroy', 'mono_mprotect', 'sched_yield']
+var do_nothing_functions = ['pthread_mutexattr_init', 'pthread_mutexattr_settype', 'pthread_mutex_init', 'pthread_mutexattr_destroy', 'pthread_mutex_lock', 'pthread_mutex_unlock', 'pthread_condattr_init', 'pthread_condattr_setclock', 'pthread_cond_init', 'pthread_condattr_destroy', 'pthread_sigmask', '_pthread_cleanup_push', '_pthread_cleanup_pop', 'pthread_self', 'pthread_create', 'pthread_mutex_trylock', 'pthread_attr_init', 'pthread_attr_setstacksize', 'pthread_attr_getstacksize', 'pthread_attr_destroy', 'sem_init', 'sem_wait', 'sem_post', 'mono_console_init', 'pthread_cond_broadcast', 'pthread_mutex_destroy', 'pthread_cond_destroy', 'mono_mprotect', 'sched_yield']
 
 for (var i in do_nothing_functions) {
   f = do_nothing_functions[i];
@@ -277,72 +442,366 @@ function _MonoImage(assembly) {
   return instance.exports.mono_assembly_get_image(assembly);
 }
 
+// Lookup caches. Classes and methods never go away, but a class which
+// can't be found may be in an assembly loaded later, so failed class lookups
+// (and the list of images) are only valid until the next assembly is opened
+// (see SYS_openat).
+var mono_assembly_generation = 0;
+var mono_images = [];
+var mono_images_generation = -1;
+var mono_classes = {};  // "namespace:name" -> { klass, generation }
+var mono_methods = {};  // "klass:flags:name" -> method
+
+function _MonoImages() {
+  if (mono_images_generation != mono_assembly_generation) {
+    mono_images = _MonoAssemblies().map(_MonoImage);
+    mono_images_generation = mono_assembly_generation;
+  }
+  return mono_images;
+}
+
 function MonoClass(namespace, name) {
+  var key = namespace + ':' + name;
+  var entry = mono_classes[key];
+  if (entry && (entry.klass || entry.generation == mono_assembly_generation)) {
+    return entry.klass;
+  }
+
   var namespace_str = heap_malloc_string(namespace);
   var name_str = heap_malloc_string(name);
-  var assemblies = _MonoAssemblies();
+  var images = _MonoImages();
   var klass = undefined;
-  for (var i in assemblies) {
-    var assembly = assemblies[i];
-    var image = _MonoImage(assembly);
-    var klass = instance.exports.mono_class_from_name(image, namespace_str,
-            name_str);
+  for (var i in images) {
+    var klass = instance.exports.mono_class_from_name(images[i],
+            namespace_str, name_str);
     if (klass) {
       break;
     }
   }
   instance.exports.free(namespace_str);
   instance.exports.free(name_str);
+
+  mono_classes[key] = { klass: klass, generation: mono_assembly_generation };
   return klass;
 }
 
+function _MonoMethodKey(klass, name, flags) {
+  return klass + ':' + flags + ':' + name;
+}
+
 function MonoMethod(klass, name, is_static) {
   var flags = (is_static ? 0x10 : 0);
+  var key = _MonoMethodKey(klass, name, flags);
+  if (key in mono_methods) {
+    return mono_methods[key];
+  }
+
   var name_str = heap_malloc_string(name);
   var method = instance.exports.mono_class_get_method_from_name_flags(klass,
           name_str, -1, flags);
   instance.exports.free(name_str);
+
+  mono_methods[key] = method;
   return method;
 }
 
-function MonoInvoke(obj, method, params) {
-  var sig = instance.exports.mono_method_signature(method);
-  var argc = instance.exports.mono_signature_get_param_count(sig);
-  if (params.length != argc) {
-    throw "invalid number of parameters";
-  }
-  var argv = 0;
-  if (argc > 0) {
-    argv = instance.exports.malloc(4 * argc);
-    for (var i in params) {
-      var param = params[i];
-      var arg = undefined;
-      if (Number.isInteger(param)) {
-        arg = instance.exports.malloc(4);
-        heap_set_int(arg, param);
+// Looks up the methods of `klass' named in the `names' array, static or not
+// depending on `is_static' (a boolean, or an array of them), and returns them
+// in an array (0 for those not found). The methods which aren't cached yet
+// are resolved with a single call into the runtime.
+function MonoMethods(klass, names, is_static) {
+  var methods = [];
+  var missing = [];
+  var flags = [];
+  for (var i = 0; i < names.length; i++) {
+    var method_static = Array.isArray(is_static) ? is_static[i] : is_static;
+    flags.push(method_static ? 0x10 : 0);
+    var key = _MonoMethodKey(klass, names[i], flags[i]);
+    if (key in mono_methods) {
+      methods.push(mono_methods[key]);
+    }
+    else {
+      methods.push(0);
+      missing.push(i);
+    }
+  }
+  if (missing.length == 0) {
+    return methods;
+  }
+
+  // The flags, then the resulting methods, then the names.
+  var names_size = 0;
+  for (var i in missing) {
+    names_size += (names[missing[i]].length * 3) + 1;
+  }
+  var buf = instance.exports.malloc((8 * missing.length) + names_size);
+  var methods_ptr = buf + (4 * missing.length);
+  var names_ptr = methods_ptr + (4 * missing.length);
+  var ptr = names_ptr;
+  for (var i in missing) {
+    heap_set_int(buf + (4 * i), flags[missing[i]]);
+    ptr += heap_set_string(ptr, names[missing[i]]) + 1;
+  }
+  instance.exports.mono_wasm_class_get_methods(klass, names_ptr, buf,
+          missing.length, methods_ptr);
+  for (var i in missing) {
+    var n = missing[i];
+    var method = heap_get_int(methods_ptr + (4 * i));
+    methods[n] = method;
+    mono_methods[_MonoMethodKey(klass, names[n], flags[n])] = method;
+  }
+  instance.exports.free(buf);
+
+  return methods;
+}
+
+// Type codes returned by mono_wasm_method_get_types() (see boot.c), from
+// mono/metadata/blob.h.
+var MONO_TYPE_VOID = 0x01
+var MONO_TYPE_BOOLEAN = 0x02
+var MONO_TYPE_CHAR = 0x03
+var MONO_TYPE_I1 = 0x04
+var MONO_TYPE_U1 = 0x05
+var MONO_TYPE_I2 = 0x06
+var MONO_TYPE_U2 = 0x07
+var MONO_TYPE_I4 = 0x08
+var MONO_TYPE_U4 = 0x09
+var MONO_TYPE_I8 = 0x0a
+var MONO_TYPE_U8 = 0x0b
+var MONO_TYPE_R4 = 0x0c
+var MONO_TYPE_R8 = 0x0d
+var MONO_TYPE_STRING = 0x0e
+var MONO_TYPE_PTR = 0x0f
+var MONO_TYPE_BYREF = 0x10
+var MONO_TYPE_I = 0x18
+var MONO_TYPE_U = 0x19
+var MONO_TYPE_OBJECT = 0x1c
+
+// Memory for the arguments of the invokers. Each call takes a frame from the
+// top of the arena and gives it back when done, so that calls can nest (C#
+// code calling into JS calling into C#). Frames which don't fit are malloc'ed.
+var invoke_arena = 0
+var invoke_arena_size = 65536
+var invoke_arena_top = 0
+
+function invoke_frame_push(size) {
+  size = (size + 7) & ~7
+  if (invoke_arena == 0) {
+    invoke_arena = instance.exports.malloc(invoke_arena_size)
+    invoke_arena_top = invoke_arena
+  }
+  if (invoke_arena_top + size > invoke_arena + invoke_arena_size) {
+    return instance.exports.malloc(size)
+  }
+  var frame = invoke_arena_top
+  invoke_arena_top += size
+  return frame
+}
+
+function invoke_frame_pop(frame) {
+  if (frame >= invoke_arena && frame < invoke_arena + invoke_arena_size) {
+    invoke_arena_top = frame
+  }
+  else {
+    instance.exports.free(frame)
+  }
+}
+
+function _MonoStringNew(str) {
+  var chars = invoke_frame_push(str.length * 2)
+  for (var i = 0; i < str.length; i++) {
+    heap_u16[(chars >> 1) + i] = str.charCodeAt(i)
+  }
+  var res = instance.exports.mono_string_new_utf16(_MonoDomain(), chars,
+          str.length)
+  invoke_frame_pop(chars)
+  return res
+}
+
+// Argument setters: store `value' in the 8-byte `slot' if needed, and return
+// what goes in the arguments array (a pointer to the value for value types,
+// the object itself for reference types).
+var invoke_arg_setters = {}
+invoke_arg_setters[MONO_TYPE_BOOLEAN] = function(value, slot) {
+  heap[slot] = value ? 1 : 0
+  return slot
+}
+invoke_arg_setters[MONO_TYPE_I1] = invoke_arg_setters[MONO_TYPE_U1] =
+  function(value, slot) {
+    heap[slot] = value
+    return slot
+  }
+invoke_arg_setters[MONO_TYPE_CHAR] = invoke_arg_setters[MONO_TYPE_I2] =
+  invoke_arg_setters[MONO_TYPE_U2] = function(value, slot) {
+    if (typeof value === 'string') {
+      value = value.charCodeAt(0)
+    }
+    heap_u16[slot >> 1] = value
+    return slot
+  }
+invoke_arg_setters[MONO_TYPE_I4] = invoke_arg_setters[MONO_TYPE_U4] =
+  invoke_arg_setters[MONO_TYPE_I] = invoke_arg_setters[MONO_TYPE_U] =
+  invoke_arg_setters[MONO_TYPE_PTR] = function(value, slot) {
+    heap_i32[slot >> 2] = value
+    return slot
+  }
+invoke_arg_setters[MONO_TYPE_I8] = invoke_arg_setters[MONO_TYPE_U8] =
+  function(value, slot) {
+    heap_set_long(slot, value)
+    return slot
+  }
+invoke_arg_setters[MONO_TYPE_R4] = function(value, slot) {
+  heap_view.setFloat32(slot, value, true)
+  return slot
+}
+invoke_arg_setters[MONO_TYPE_R8] = function(value, slot) {
+  heap_view.setFloat64(slot, value, true)
+  return slot
+}
+invoke_arg_setters[MONO_TYPE_STRING] = function(value, slot) {
+  return value == null ? 0 : _MonoStringNew(String(value))
+}
+invoke_arg_setters[MONO_TYPE_OBJECT] = function(value, slot) {
+  return value || 0 // a MonoObject pointer
+}
+
+// Return value getters, from the (boxed) object mono_runtime_invoke()
+// returned.
+function _MonoUnbox(res) {
+  return instance.exports.mono_object_unbox(res)
+}
+
+var invoke_ret_getters = {}
+invoke_ret_getters[MONO_TYPE_VOID] = function(res) {
+  return undefined
+}
+invoke_ret_getters[MONO_TYPE_BOOLEAN] = function(res) {
+  return heap[_MonoUnbox(res)] != 0
+}
+invoke_ret_getters[MONO_TYPE_I1] = function(res) {
+  return heap_view.getInt8(_MonoUnbox(res))
+}
+invoke_ret_getters[MONO_TYPE_U1] = function(res) {
+  return heap[_MonoUnbox(res)]
+}
+invoke_ret_getters[MONO_TYPE_I2] = function(res) {
+  return heap_view.getInt16(_MonoUnbox(res), true)
+}
+invoke_ret_getters[MONO_TYPE_U2] = function(res) {
+  return heap_get_short(_MonoUnbox(res))
+}
+invoke_ret_getters[MONO_TYPE_CHAR] = function(res) {
+  return String.fromCharCode(heap_get_short(_MonoUnbox(res)))
+}
+invoke_ret_getters[MONO_TYPE_I4] = invoke_ret_getters[MONO_TYPE_I] =
+  function(res) {
+    return heap_get_int(_MonoUnbox(res))
+  }
+invoke_ret_getters[MONO_TYPE_U4] = invoke_ret_getters[MONO_TYPE_U] =
+  invoke_ret_getters[MONO_TYPE_PTR] = function(res) {
+    return heap_get_int(_MonoUnbox(res)) >>> 0
+  }
+invoke_ret_getters[MONO_TYPE_I8] = function(res) {
+  return heap_get_long(_MonoUnbox(res))
+}
+invoke_ret_getters[MONO_TYPE_U8] = function(res) {
+  return heap_get_ulong(_MonoUnbox(res))
+}
+invoke_ret_getters[MONO_TYPE_R4] = function(res) {
+  return heap_view.getFloat32(_MonoUnbox(res), true)
+}
+invoke_ret_getters[MONO_TYPE_R8] = function(res) {
+  return heap_view.getFloat64(_MonoUnbox(res), true)
+}
+invoke_ret_getters[MONO_TYPE_STRING] = function(res) {
+  return res ? heap_get_mono_string(res) : null
+}
+invoke_ret_getters[MONO_TYPE_OBJECT] = function(res) {
+  return res // a MonoObject pointer
+}
+
+function _MonoMethodTypes(method) {
+  var max = 16
+  while (true) {
+    var types_ptr = instance.exports.malloc(4 * max)
+    var argc = instance.exports.mono_wasm_method_get_types(method, types_ptr,
+            max)
+    var types = []
+    for (var i = 0; i <= argc && i < max; i++) {
+      types.push(heap_get_int(types_ptr + (i * 4)))
+    }
+    instance.exports.free(types_ptr)
+    if (argc < 0) {
+      throw "can't load the signature of method " + method
+    }
+    if (argc < max) {
+      return types
+    }
+    max = argc + 1
+  }
+}
+
+// Returns a function calling `method' (with `this' as first argument, 0 for
+// static methods, followed by the method arguments) which converts its
+// arguments and return value according to the method signature, looked up
+// once here. Strings, numbers and booleans are passed as is, objects as
+// MonoObject pointers.
+function MonoInvoker(method) {
+  var types = _MonoMethodTypes(method)
+  var getter = invoke_ret_getters[types[0]]
+  if (!getter) {
+    throw "unsupported return type " + types[0]
+  }
+  var argc = types.length - 1
+  var setters = []
+  for (var i = 1; i <= argc; i++) {
+    var setter = invoke_arg_setters[types[i]]
+    if (!setter) {
+      throw "unsupported param type " + types[i]
+    }
+    setters.push(setter)
+  }
+  // The arguments array, then a slot for each value.
+  var slots_offset = ((4 * argc) + 7) & ~7
+  var frame_size = slots_offset + (8 * argc)
+
+  return function(obj) {
+    if (arguments.length != argc + 1) {
+      throw "invalid number of parameters";
+    }
+    var argv = 0
+    if (argc > 0) {
+      argv = invoke_frame_push(frame_size)
+      var slots = argv + slots_offset
+      for (var i = 0; i < argc; i++) {
+        // Setters can allocate, thus grow the heap.
+        var arg = setters[i](arguments[i + 1], slots + (i * 8))
+        heap_i32[(argv >> 2) + i] = arg
       }
-      else if (typeof param === 'string') {
-        var param_str = heap_malloc_string(param);        
-        arg = instance.exports.mono_string_new(_MonoDomain(), param_str)
-        instance.exports.free(param_str);
+    }
+    try {
+      var res = instance.exports.mono_runtime_invoke(method, obj, argv, 0)
+    }
+    finally {
+      if (argc > 0) {
+        invoke_frame_pop(argv)
       }
-      else {
-        throw "unsupported param type";
+      if (out_pending) {
+        out_flush_all(false)
       }
-      heap_set_int(argv + (i * 4), arg);
     }
+    return getter(res)
   }
-  var res = instance.exports.mono_runtime_invoke(method, obj, argv);
-  if (argc > 0) {
-    //for (var i = 0; i < argc; i++) {
-    //  instance.exports.free(heap_get_int(argv + (i * 4)))
-    //}
-    instance.exports.free(argv);
+}
+
+var mono_invokers = {}
+
+function MonoInvoke(obj, method, params) {
+  var invoker = mono_invokers[method]
+  if (!invoker) {
+    invoker = mono_invokers[method] = MonoInvoker(method)
   }
-  //if (res) {
-  //  res = instance.exports.mono_object_unbox(res);
-  //}
-  return res;
+  return invoker.apply(null, [obj].concat(params))
 }
 
 // System calls.
@@ -352,21 +811,162 @@ fds[0] = undefined
 fds[1] = undefined
 fds[2] = undefined
 
-var out_buffer = '';
+// Output on stdout and stderr. The bytes written are kept per fd and decoded
+// in bulk, then passed by batches of complete lines to the output function
+// (log() by default): when the buffer is full, when out_flush_interval
+// milliseconds passed since the last flush (so that a long-running program
+// still shows its output), when the program returns to JS (see MonoInvoker()
+// and run_wasm_code()), or before other messages. stderr is flushed at each
+// complete line. What remains of the last line is flushed when the program
+// ends.
+var out_buffer_flush_size = 65536
+var out_flush_interval = 100
+var out_buffers = {} // fd -> { bytes, len, decoder, flushed }
+// Whether output was added since the last out_flush_all(), which only has
+// complete lines to flush if so.
+var out_pending = false
+
+function out_buffer_add(fd, ptr, len) {
+  var out = out_buffers[fd]
+  if (!out) {
+    out = out_buffers[fd] = {
+      bytes: new Uint8Array(4096),
+      len: 0,
+      decoder: utf8_decoder ? new TextDecoder('utf-8') : undefined,
+      flushed: clock_now()
+    }
+  }
+  if (out.len + len > out.bytes.length) {
+    var size = out.bytes.length * 2
+    while (size < out.len + len) {
+      size *= 2
+    }
+    var bytes = new Uint8Array(size)
+    bytes.set(out.bytes.subarray(0, out.len))
+    out.bytes = bytes
+  }
+  out.bytes.set(heap.subarray(ptr, ptr + len), out.len)
+  out.len += len
+  out_pending = true
+  if (out.len >= out_buffer_flush_size || fd == 2 || debug_logs
+      || clock_now() - out.flushed >= out_flush_interval) {
+    out_flush(fd, false)
+  }
+}
 
-function out_buffer_add(ptr, len) {
-  out_buffer += heap_get_string(ptr, len)
+// Outputs the complete lines (or everything, if `all') written on `fd'.
+function out_flush(fd, all) {
+  var out = out_buffers[fd]
+  if (!out || out.len == 0) {
+    return
+  }
+  out.flushed = clock_now()
+  var end = all ? out.len
+    : out.bytes.subarray(0, out.len).lastIndexOf(10) + 1 // '\n'
+  if (end == 0) {
+    return
+  }
+  // A partial line can end in the middle of a character, whose first bytes
+  // the decoder of the fd keeps for the next flush.
+  var bytes = out.bytes.subarray(0, end)
+  var text = out.decoder ? out.decoder.decode(bytes, { stream: !all })
+    : utf8_decode(bytes)
+  out.bytes.copyWithin(0, end, out.len)
+  out.len -= end
+  if (text.charAt(text.length - 1) == '\n') {
+    text = text.substr(0, text.length - 1)
+  }
+  if (mono_wasm_output) {
+    mono_wasm_output(fd, text)
+  }
+  else {
+    log(text)
+  }
 }
 
-function out_buffer_flush() {
-  if (out_buffer.charAt(out_buffer.length - 1) == '\n') {
-    log(out_buffer.substr(0, out_buffer.length - 1))
-    out_buffer = ''
+function out_flush_all(all) {
+  out_pending = false
+  for (var fd in out_buffers) {
+    out_flush(fd, all)
   }
 }
 
 var files_content = {}
-var syscalls = {}
+
+// Files mapped as a whole (see mmap()), whose content only lives in memory:
+// name -> { addr, size }.
+var files_mapped = {}
+
+function file_is_available(name) {
+  return files_content[name] !== undefined || files_mapped[name] !== undefined
+}
+
+function file_is_eager(name) {
+  var info = files_manifest[name]
+  return !info || info.eager
+}
+
+function file_loaded(name, buf) {
+  var info = files_manifest[name]
+  if (info && info.size != buf.length) {
+    error('file ' + name + ' has ' + buf.length + ' bytes, expected '
+            + info.size)
+  }
+  files_content[name] = buf
+}
+
+// Returns the content of a file, loading it if needed. A mapped file is
+// copied back from its mapping. Otherwise in the browser this is a
+// synchronous request (unless a prefetch got the file already), in which the
+// response can only be text.
+function file_content(name) {
+  var mapped = files_mapped[name]
+  if (!files_content[name] && mapped) {
+    files_content[name] = heap.slice(mapped.addr, mapped.addr + mapped.size)
+  }
+  if (!files_content[name]) {
+    debug('loading ' + name)
+    if (browser_environment) {
+      var xhr = new XMLHttpRequest()
+      xhr.open('GET', name, false)
+      xhr.overrideMimeType('text/plain; charset=x-user-defined')
+      xhr.send(null)
+      if (xhr.status != 200) {
+        error('loading ' + name + ' failed: ' + xhr.status)
+        return undefined
+      }
+      var text = xhr.responseText
+      var buf = new Uint8Array(text.length)
+      for (var i = 0; i < text.length; i++) {
+        buf[i] = text.charCodeAt(i) & 0xff
+      }
+      file_loaded(name, buf)
+    }
+    else {
+      file_loaded(name, new Uint8Array(readbuffer(name)))
+    }
+  }
+  return files_content[name]
+}
+
+// Downloads in the background the files that aren't loaded yet, except the
+// ones `skip' returns true for, so that opening them later doesn't block.
+// Started before booting, these downloads run while the code compiles.
+function files_prefetch(skip) {
+  files.forEach(function(name) {
+    if (!skip(name) && !file_is_available(name)) {
+      fetch_buffer(name).then(function(buf) {
+        if (!file_is_available(name)) {
+          file_loaded(name, new Uint8Array(buf))
+        }
+      }).catch(function(e) {
+        debug('prefetching ' + name + ' failed: ' + e)
+      })
+    }
+  })
+}
+// Indexed by syscall number (i386 numbering, as the C library uses).
+var syscalls = []
 
 syscalls[3] = function SYS_read(fd, buf, len) {
   var obj = fds[fd]
@@ -383,8 +983,7 @@ syscalls[3] = function SYS_read(fd, buf, len) {
 
 syscalls[4] = function SYS_write(fd, buf, len) {
   if (fd == 1 || fd == 2) {
-    out_buffer_add(buf, len)
-    out_buffer_flush()
+    out_buffer_add(fd, buf, len)
     return len
   }
   error('write() called with invalid fd ' + fd)
@@ -404,25 +1003,84 @@ syscalls[20] = function SYS_getpid() {
   return 42
 }
 
+// Memory management. The program break (see brk()) starts at the end of the
+// initial memory, which grows geometrically (by `growth', up to `maximum'
+// bytes) when the break goes past it, so that the many small expansions of
+// the allocator don't each grow the memory.
+var memory_config = { initial: 0, maximum: 2147483648, growth: 1.5 }
+if (typeof mono_wasm_memory != "undefined") {
+  for (var key in mono_wasm_memory) {
+    memory_config[key] = mono_wasm_memory[key]
+  }
+}
+
+var memory_stats = {
+  brk_calls: 0,
+  grow_calls: 0,
+  grown_bytes: 0,
+  mmap_calls: 0,
+  mmap_bytes: 0,
+  munmap_calls: 0
+}
+
+// Returns the memory counters, for profiling.
+function MonoMemoryStats() {
+  var stats = { heap_size: heap_size, brk: brk_current }
+  for (var key in memory_stats) {
+    stats[key] = memory_stats[key]
+  }
+  return stats
+}
+
+// Grows the memory to at least `size' bytes, returns false if it can't.
+function memory_grow(size) {
+  if (size <= heap_size) {
+    return true
+  }
+  if (size > memory_config.maximum) {
+    return false
+  }
+  var memory = instance.exports.memory
+  var target = Math.min(Math.max(size, heap_size * memory_config.growth),
+          memory_config.maximum)
+  var pages = Math.ceil((target - heap_size) / 65536)
+  var min_pages = Math.ceil((size - heap_size) / 65536)
+  try {
+    memory.grow(pages)
+  }
+  catch (e) {
+    // Over the maximum of the module, maybe the minimum still fits.
+    try {
+      memory.grow(min_pages)
+    }
+    catch (e) {
+      return false
+    }
+  }
+  var old_size = heap_size
+  heap_update()
+  memory_stats.grow_calls++
+  memory_stats.grown_bytes += heap_size - old_size
+  debug("memory: heap " + heap_human(old_size) + " -> "
+          + heap_human(heap_size))
+  return true
+}
+
 var brk_current = 0
-syscalls[45] = function SYS_brk(inc) {
-  if (inc == 0) {
-    brk_current = heap_size;
-    debug("brk: current heap " + heap_human(brk_current))
-    return brk_current;
-  }
-  if (brk_current + inc > heap_size) {
-    var delta = inc - (heap_size - brk_current)
-    brk_current += inc
-    var new_pages_needed = Math.ceil(delta / 65536.0)
-    var memory = instance.exports.memory
-    var n = memory.grow(new_pages_needed);
-    var new_heap_size = memory.buffer.byteLength
-    debug("brk: pages " + n + " -> " + (n + new_pages_needed) + " (+" + new_pages_needed + "), heap " + heap_human(heap_size) + " -> " + heap_human(new_heap_size) + " (+" + heap_human(new_heap_size - heap_size) + ")")
-    heap = new Uint8Array(memory.buffer)
-    heap_size = new_heap_size
-  }
-  return inc
+syscalls[45] = function SYS_brk(addr) {
+  memory_stats.brk_calls++
+  if (brk_current == 0) {
+    brk_current = heap_size
+  }
+  // Like Linux, returns the new break, or the current one on failure.
+  if (addr > brk_current && !memory_grow(addr)) {
+    debug("brk: can't grow to " + heap_human(addr))
+    return brk_current
+  }
+  if (addr != 0) {
+    brk_current = addr
+  }
+  return brk_current
 }
 
 syscalls[54] = function SYS_ioctl(fd, req, arg) {
@@ -461,11 +1119,12 @@ syscalls[146] = function SYS_writev(fd, iovs, iov_count) {
     for (var i = 0; i < iov_count; i++) {
       var base = heap_get_int(iovs + (i * 8))
       var len = heap_get_int(iovs + 4 + (i * 8))
-      debug("write fd: " + fd + ", base: " + base + ", len: " + len)
-      out_buffer_add(base, len)
+      if (debug_logs) {
+        debug("write fd: " + fd + ", base: " + base + ", len: " + len)
+      }
+      out_buffer_add(fd, base, len)
       all_lens += len
     }
-    out_buffer_flush()
     return all_lens
   }
   error("can only write on stdout and stderr") 
@@ -500,6 +1159,10 @@ syscalls[106] = function SYS_stat(path, s) {
     var file = "/" + files[i];
     if (path_str == file) {
       heap_set_int(s + 16, 0100000)   // st_mode -> S_IFREG
+      var info = files_manifest[files[i]]
+      if (info) {
+        heap_set_int(s + 40, info.size) // st_size, without loading the file
+      }
       return 0
     }
   }
@@ -562,9 +1225,15 @@ syscalls[224] = function SYS_gettid() {
 
 syscalls[219] = function SYS_madvise(addr, len, advice) {
   if (advice == 4) {
-    // TODO
+    // MADV_DONTNEED: anonymous memory then reads as zeroes.
+    if (mmap_anon_find(addr)) {
+      heap.fill(0, addr, addr + len)
+    }
     return 0
   }
+  if (advice >= 0 && advice <= 3) {
+    return 0 // just hints
+  }
   return -1
 }
 
@@ -584,6 +1253,7 @@ syscalls[238] = function SYS_tkill(tid, signal) {
 }
 
 syscalls[252] = function SYS_exit(code) {
+  out_flush_all(true)
   log("exit(" + code + "): " + new Error().stack)
   throw new TerminateWasmException('exit(' + code + ')');
 }
@@ -625,14 +1295,15 @@ syscalls[295] = function SYS_openat(at, filename, flags, mode) {
         var obj = {};
         obj['offset'] = 0;
         obj['path'] = filename_str;
-        var buf = files_content[filename_str]
+        var buf = file_content(filename_str)
         if (!buf) {
-          buf = new Uint8Array(readbuffer(filename_str))
-          files_content[filename_str] = buf
-        } 
+          return -1
+        }
         obj['content'] = buf
         fd = Object.keys(fds).length;
         fds[fd] = obj;
+        // Only assemblies are opened, this one might be about to be loaded.
+        mono_assembly_generation++
       }
       debug('open("' + filename_str + '") -> ' + fd);
       return fd
@@ -651,68 +1322,710 @@ syscalls[375] = function SYS_membarrier() {
   return 0
 }
 
-function route_syscall() {
-  n = arguments[0]
-  argv = [].slice.call(arguments, 1)
-  f = syscalls[n]
-  name = f ? f.name : n
-  debug('syscall(' + name + (argv.length > 0 ? ', ' + argv.join(', ') : '')
-              + ')')
-  if (!f) {
-    error('unimplemented syscall ' + n + ' called')
+// mmap() of files, which the runtime uses to load assemblies (see USE_MMAP in
+// the Makefile). There is no virtual memory, so the content is copied once
+// into memory from malloc() and the runtime uses it from there instead of
+// making its own copy. Mapping the same part of a file again shares the same
+// memory, which is freed once every mapping of it is gone.
+var MAP_FAILED = -1
+var MAP_ANONYMOUS = 0x20
+
+var mmap_regions = {} // address -> { key, len, refs }
+var mmap_keys = {}    // "path:offset:length" -> address
+
+// Anonymous mappings (the GC heap) come from memalign(), sorted by address.
+// The GC unmaps parts of them (e.g. the head and the tail of a larger mapping
+// made to get an aligned one), which are kept per region as sorted, disjoint
+// [start, end) ranges. New mappings reuse these ranges first, and a region is
+// only freed once all of it has been unmapped.
+var mmap_page_size = 65536
+var mmap_anon_regions = [] // { addr, len, unmapped: [[start, end], ...] }
+
+function mmap_anon_find(addr) {
+  var lo = 0
+  var hi = mmap_anon_regions.length - 1
+  while (lo <= hi) {
+    var mid = (lo + hi) >> 1
+    var region = mmap_anon_regions[mid]
+    if (addr < region.addr) {
+      hi = mid - 1
+    }
+    else if (addr >= region.addr + region.len) {
+      lo = mid + 1
+    }
+    else {
+      return region
+    }
+  }
+  return undefined
+}
+
+// Adds [start, end) to the sorted, disjoint `ranges', merging it with the
+// ones it overlaps or touches, and returns the number of bytes it added.
+function ranges_add(ranges, start, end) {
+  var added = end - start
+  var i = 0
+  while (i < ranges.length && ranges[i][1] < start) {
+    i++
+  }
+  var j = i
+  var merged_start = start
+  var merged_end = end
+  while (j < ranges.length && ranges[j][0] <= end) {
+    added -= Math.max(0, Math.min(end, ranges[j][1])
+                        - Math.max(start, ranges[j][0]))
+    merged_start = Math.min(merged_start, ranges[j][0])
+    merged_end = Math.max(merged_end, ranges[j][1])
+    j++
+  }
+  ranges.splice(i, j - i, [merged_start, merged_end])
+  return added
+}
+
+// Takes `len' bytes, aligned on a page, from the unmapped ranges of the
+// regions. Returns 0 if none of them is large enough.
+function mmap_anon_reuse(len) {
+  for (var i = 0; i < mmap_anon_regions.length; i++) {
+    var ranges = mmap_anon_regions[i].unmapped
+    for (var j = 0; j < ranges.length; j++) {
+      var range = ranges[j]
+      var addr = Math.ceil(range[0] / mmap_page_size) * mmap_page_size
+      if (addr + len > range[1]) {
+        continue
+      }
+      var rest = []
+      if (range[0] < addr) {
+        rest.push([range[0], addr])
+      }
+      if (addr + len < range[1]) {
+        rest.push([addr + len, range[1]])
+      }
+      ranges.splice.apply(ranges, [j, 1].concat(rest))
+      return addr
+    }
+  }
+  return 0
+}
+
+// memalign() could itself map memory, if the allocator was built to (see
+// HAVE_MMAP in dlmalloc), which would recurse forever. Failing the inner
+// mapping makes it use the program break instead.
+var mmap_anon_allocating = false
+
+function mmap_anon(len) {
+  len = Math.ceil(len / mmap_page_size) * mmap_page_size
+  var addr = mmap_anon_reuse(len)
+  if (addr != 0) {
+    heap.fill(0, addr, addr + len)
+    memory_stats.mmap_bytes += len
+    debug('mmap(' + len + ') -> ' + addr + ' (reused)')
+    return addr
+  }
+
+  if (mmap_anon_allocating) {
+    return MAP_FAILED
+  }
+  mmap_anon_allocating = true
+  try {
+    addr = instance.exports.memalign(mmap_page_size, len)
+  }
+  finally {
+    mmap_anon_allocating = false
+  }
+  if (addr == 0) {
+    return MAP_FAILED
+  }
+  heap.fill(0, addr, addr + len)
+  var region = { addr: addr, len: len, unmapped: [] }
+  var i = 0
+  while (i < mmap_anon_regions.length && mmap_anon_regions[i].addr < addr) {
+    i++
+  }
+  mmap_anon_regions.splice(i, 0, region)
+  memory_stats.mmap_bytes += len
+  debug('mmap(' + len + ') -> ' + addr)
+  return addr
+}
+
+function munmap_anon(region, addr, len) {
+  var start = Math.max(addr, region.addr)
+  var end = Math.min(addr + len, region.addr + region.len)
+  if (start >= end) {
+    return
+  }
+  memory_stats.mmap_bytes -= ranges_add(region.unmapped, start, end)
+  var ranges = region.unmapped
+  if (ranges.length == 1 && ranges[0][0] == region.addr
+      && ranges[0][1] == region.addr + region.len) {
+    mmap_anon_regions.splice(mmap_anon_regions.indexOf(region), 1)
+    instance.exports.free(region.addr)
+  }
+}
+
+function mmap(start, len, prot, flags, fd, off) {
+  memory_stats.mmap_calls++
+  if (flags & MAP_ANONYMOUS) {
+    return mmap_anon(len)
+  }
+
+  // off_t is 64-bit, which engines pass as a BigInt (or a Number, when
+  // lowered by the toolchain).
+  off = Number(off)
+  var obj = fds[fd]
+  if (!obj) {
+    error('mmap() called with invalid fd ' + fd)
+    return MAP_FAILED
+  }
+
+  var path = obj['path']
+  var content = obj['content']
+  var key = path + ':' + off + ':' + len
+  var addr = mmap_keys[key]
+  if (addr !== undefined) {
+    mmap_regions[addr].refs++
+    debug('mmap("' + path + '", ' + off + ', ' + len + ') -> ' + addr
+            + ' (shared)')
+  }
+  else {
+    addr = instance.exports.malloc(len)
+    if (addr == 0) {
+      return MAP_FAILED
+    }
+    var data = content.subarray(off, off + len)
+    heap.set(data, addr)
+    // Past the end of the file, the mapping reads as zeroes.
+    heap.fill(0, addr + data.length, addr + len)
+    mmap_regions[addr] = { key: key, path: path, len: len, refs: 1 }
+    mmap_keys[key] = addr
+    debug('mmap("' + path + '", ' + off + ', ' + len + ') -> ' + addr)
+  }
+
+  // Once the whole file lives in memory, the JS copy is only kept until the
+  // file descriptor is closed (file_content() copies it back from the
+  // mapping if the file is reopened).
+  if (off == 0 && len >= content.length) {
+    files_mapped[path] = { addr: addr, size: content.length }
+    delete files_content[path]
+  }
+  return addr
+}
+
+function munmap(addr, len) {
+  memory_stats.munmap_calls++
+  var anon_region = mmap_anon_find(addr)
+  if (anon_region) {
+    debug('munmap(' + addr + ', ' + len + ')')
+    munmap_anon(anon_region, addr, len)
+    return 0
+  }
+  var region = mmap_regions[addr]
+  if (!region) {
+    error('munmap() called with invalid address ' + addr)
     return -1
   }
-  return f.apply(this, argv)
+  debug('munmap(' + addr + ', ' + len + ')')
+  if (--region.refs == 0) {
+    var mapped = files_mapped[region.path]
+    if (mapped && mapped.addr == addr) {
+      delete files_mapped[region.path]
+    }
+    delete mmap_regions[addr]
+    delete mmap_keys[region.key]
+    instance.exports.free(addr)
+  }
+  return 0
+}
+
+functions['env']['mmap'] = functions['env']['__mmap'] = mmap
+functions['env']['munmap'] = functions['env']['__munmap'] = munmap
+
+// The C library calls __syscallN(n, ...) with the N arguments of syscall n.
+// There is one dispatch function per arity, so that calls don't allocate,
+// and the arguments are only formatted when debugging (they are passed as an
+// array then, as mentioning `arguments' would allocate it at each call).
+function syscall_trace(n, args) {
+  var f = syscalls[n]
+  debug('syscall(' + (f ? f.name : n)
+          + (args.length > 0 ? ', ' + args.join(', ') : '') + ')')
+}
+
+function syscall_missing(n) {
+  error('unimplemented syscall ' + n + ' called')
+  return -1
+}
+
+function syscall0(n) {
+  if (debug_logs) syscall_trace(n, [])
+  var f = syscalls[n]
+  return f ? f() : syscall_missing(n)
+}
+
+function syscall1(n, a) {
+  if (debug_logs) syscall_trace(n, [a])
+  var f = syscalls[n]
+  return f ? f(a) : syscall_missing(n)
+}
+
+function syscall2(n, a, b) {
+  if (debug_logs) syscall_trace(n, [a, b])
+  var f = syscalls[n]
+  return f ? f(a, b) : syscall_missing(n)
+}
+
+function syscall3(n, a, b, c) {
+  if (debug_logs) syscall_trace(n, [a, b, c])
+  var f = syscalls[n]
+  return f ? f(a, b, c) : syscall_missing(n)
+}
+
+function syscall4(n, a, b, c, d) {
+  if (debug_logs) syscall_trace(n, [a, b, c, d])
+  var f = syscalls[n]
+  return f ? f(a, b, c, d) : syscall_missing(n)
+}
+
+function syscall5(n, a, b, c, d, e) {
+  if (debug_logs) syscall_trace(n, [a, b, c, d, e])
+  var f = syscalls[n]
+  return f ? f(a, b, c, d, e) : syscall_missing(n)
 }
 
-for (var i in [0, 1, 2, 3, 4, 5, 6]) {
-  functions['env']['__syscall' + i] = route_syscall
+function syscall6(n, a, b, c, d, e, g) {
+  if (debug_logs) syscall_trace(n, [a, b, c, d, e, g])
+  var f = syscalls[n]
+  return f ? f(a, b, c, d, e, g) : syscall_missing(n)
 }
-functions['env']['__syscall_cp'] = route_syscall
 
-function run_wasm_code() {
-  heap = new Uint8Array(instance.exports.memory.buffer);
-  heap_size = instance.exports.memory.buffer.byteLength;
-  
+functions['env']['__syscall0'] = syscall0
+functions['env']['__syscall1'] = syscall1
+functions['env']['__syscall2'] = syscall2
+functions['env']['__syscall3'] = syscall3
+functions['env']['__syscall4'] = syscall4
+functions['env']['__syscall5'] = syscall5
+functions['env']['__syscall6'] = syscall6
+functions['env']['__syscall_cp'] = syscall6
+
+// Boots the runtime, up to running Main() (see mono_wasm_run()).
+function mono_boot() {
   if (dump_cross_offsets) {
     // We don't care about freeing the memory as we exit soon after.
     instance.exports.setenv(heap_malloc_string('DUMP_CROSS_OFFSETS'),
             heap_malloc_string('1'), 1)
   }
- 
+
+  debug("booting")
+  try {
+    timeline_phase('boot', function() {
+      instance.exports.mono_wasm_boot(heap_malloc_string(files[0]),
+              debug_logs)
+    })
+  }
+  finally {
+    out_flush_all(true)
+    timeline_runtime_read()
+  }
+}
+
+// Memory snapshot. Booting the runtime always does the same work, so
+// `mono-wasm --snapshot' runs it once at build time, in a JS shell (see
+// snapshot_save()), and index.js then restores the memory and the JS state of
+// the system calls as they were once booted. The only WASM global changed by
+// the code, the stack pointer, is back to its initial value at that point.
+//
+// index.snapshot holds the length of a JSON header (32-bit little endian),
+// the header, then the memory up to its last non-zero byte.
+function snapshot_state() {
+  var state = {
+    hash: files_hash,
+    heap_size: heap_size,
+    brk_current: brk_current,
+    tls_variables: tls_variables,
+    fds: {},
+    signals: {},
+    mono_assembly_generation: mono_assembly_generation,
+    mmap_regions: mmap_regions,
+    mmap_keys: mmap_keys,
+    mmap_anon_regions: mmap_anon_regions,
+    files_mapped: files_mapped,
+    memory_stats: memory_stats
+  }
+  for (var fd in fds) {
+    var obj = fds[fd]
+    // The content is loaded again when restoring.
+    state.fds[fd] = obj ? { path: obj['path'], offset: obj['offset'] } : null
+  }
+  for (var sig in signals) {
+    state.signals[sig] = Array.prototype.slice.call(signals[sig])
+  }
+  return state
+}
+
+function snapshot_save(path) {
+  if (!utf8_encoder) {
+    error("making a snapshot requires TextEncoder")
+    return false
+  }
+  mono_boot()
+
+  var header = utf8_encoder.encode(JSON.stringify(snapshot_state()))
+  var end = heap_size
+  while (end > 0 && heap[end - 1] == 0) {
+    end--
+  }
+  var bytes = new Uint8Array(4 + header.length + end)
+  new DataView(bytes.buffer).setUint32(0, header.length, true)
+  bytes.set(header, 4)
+  bytes.set(heap.subarray(0, end), 4 + header.length)
+  if (!shell_write_file(path, bytes)) {
+    return false
+  }
+  log('snapshot: ' + path + ', ' + heap_human(end) + ' of memory')
+  return true
+}
+
+// Returns the state saved in the snapshot header, or undefined if the
+// snapshot doesn't match this build.
+function snapshot_header(buf) {
+  var header_len = new DataView(buf).getUint32(0, true)
+  var state = JSON.parse(utf8_decode(new Uint8Array(buf, 4, header_len)))
+  return state.hash == files_hash ? state : undefined
+}
+
+// Returns false if the snapshot doesn't match this build, in which case the
+// runtime has to boot. `initial_size' is the size of the memory the instance
+// started with, which is the only part that may not be zeroes.
+function snapshot_restore(buf, initial_size) {
+  var bytes = new Uint8Array(buf)
+  var header_len = new DataView(buf).getUint32(0, true)
+  var state = snapshot_header(buf)
+  if (!state) {
+    debug('snapshot: built for other files, booting')
+    return false
+  }
+  var start = clock_now()
+  var memory = bytes.subarray(4 + header_len)
+  if (!memory_grow(Math.max(state.heap_size, memory.length))) {
+    error("snapshot: can't grow the memory to "
+            + heap_human(state.heap_size))
+    return false
+  }
+  heap.set(memory, 0)
+  if (memory.length < initial_size) {
+    heap.fill(0, memory.length, initial_size)
+  }
+
+  brk_current = state.brk_current
+  tls_variables = state.tls_variables
+  // Before the files are opened again, as the mapped ones are in memory.
+  files_mapped = state.files_mapped
+  for (var fd in state.fds) {
+    var obj = state.fds[fd]
+    if (obj) {
+      obj['content'] = file_content(obj['path'])
+    }
+    fds[fd] = obj || undefined
+  }
+  for (var sig in state.signals) {
+    signals[sig] = new Uint8Array(state.signals[sig])
+  }
+  mono_assembly_generation = state.mono_assembly_generation
+  mmap_regions = state.mmap_regions
+  mmap_keys = state.mmap_keys
+  mmap_anon_regions = state.mmap_anon_regions
+  memory_stats = state.memory_stats
+  timeline_add('snapshot restore', start, clock_now())
+  debug('snapshot: restored ' + heap_human(memory.length) + ' of memory')
+  return true
+}
+
+// `snapshot' is the content of snapshot_file, if any.
+function run_wasm_code(snapshot) {
+  heap_update();
+  // The break starts after the data and stack, the rest of the initial
+  // memory being for it to grow into.
+  var initial_size = heap_size;
+  brk_current = heap_size;
+  memory_grow(memory_config.initial);
+
+  if (!snapshot || !snapshot_restore(snapshot, initial_size)) {
+    mono_boot()
+  }
+
   debug("running main()")
-  var ret = instance.exports.mono_wasm_main(heap_malloc_string(files[0]),
-          debug_logs);
+  try {
+    var ret = instance.exports.mono_wasm_run(debug_logs);
+  }
+  finally {
+    out_flush_all(true);
+    timeline_runtime_read();
+  }
   debug('main() returned: ' + ret);
 }
 
-if (browser_environment) {
-  fetch('index.wasm').then(function(response) {
+// The page can start these downloads even earlier, with the preload hints that
+// `mono-wasm' writes in index.preload.html.
+function fetch_buffer(url) {
+  return fetch(url).then(function(response) {
+    if (!response.ok) {
+      throw new Error('fetching ' + url + ' failed: ' + response.status)
+    }
     return response.arrayBuffer()
+  })
+}
+
+function wasm_instantiate_buffer(url) {
+  return timeline_phase('download ' + url, function() {
+    return fetch_buffer(url)
   }).then(function(buf) {
-    return WebAssembly.compile(buf)
-  }).then(function(mod) {
-    return WebAssembly.instantiate(mod, functions)
-  }).then(function(i) {
-    instance = i
-    var files_promises = [];
-    files.forEach(function(url, i) {
-      files_promises.push(
-        fetch(url).then(function(res){
-          return res.arrayBuffer();
-        }).then(function(buf){
-          files_content[url] = new Uint8Array(buf)
+    return timeline_phase('compile ' + url, function() {
+      return WebAssembly.instantiate(buf, functions)
+    })
+  })
+}
+
+function wasm_instantiate(url) {
+  // instantiateStreaming() compiles the code while it downloads (so that the
+  // phase covers both), but requires the server to send the application/wasm
+  // MIME type.
+  if (WebAssembly.instantiateStreaming) {
+    return timeline_phase('download and compile ' + url, function() {
+      return WebAssembly.instantiateStreaming(fetch(url), functions)
+    }).catch(function(e) {
+      debug('streaming compilation failed (' + e + '), falling back')
+      return wasm_instantiate_buffer(url)
+    })
+  }
+  return wasm_instantiate_buffer(url)
+}
+
+// Browser cache of the compiled code and of the files, for repeat visits. A
+// storage object has get(key) and put(key, value) methods returning promises,
+// the value being { hash, module, files } where `module' is the compiled
+// WebAssembly.Module (or the index.wasm bytes, if the storage can't keep
+// modules) and `files' maps file names to their bytes.
+function idb_request(request) {
+  return new Promise(function(resolve, reject) {
+    request.onsuccess = function() { resolve(request.result) }
+    request.onerror = function() { reject(request.error) }
+  })
+}
+
+function idb_storage_open() {
+  var open = indexedDB.open('mono-wasm', 1)
+  open.onupgradeneeded = function() {
+    open.result.createObjectStore('cache')
+  }
+  return idb_request(open).then(function(db) {
+    return {
+      get: function(key) {
+        return idb_request(db.transaction('cache').objectStore('cache')
+                .get(key))
+      },
+      put: function(key, value) {
+        return idb_request(db.transaction('cache', 'readwrite')
+                .objectStore('cache').put(value, key))
+      }
+    }
+  })
+}
+
+function cache_open() {
+  if (!mono_wasm_cache || !files_hash) {
+    return Promise.resolve(undefined)
+  }
+  if (mono_wasm_cache !== true) {
+    return Promise.resolve(mono_wasm_cache)
+  }
+  if (typeof indexedDB == "undefined") {
+    return Promise.resolve(undefined)
+  }
+  return idb_storage_open()
+}
+
+// One entry per page, replaced when the files change.
+function cache_key() {
+  return typeof location != "undefined" ? location.pathname : 'index'
+}
+
+function cache_load(cache) {
+  return cache.get(cache_key()).then(function(entry) {
+    if (!entry || entry.hash != files_hash) {
+      return false
+    }
+    debug('loading from cache')
+    for (var name in entry.files) {
+      var file = entry.files[name]
+      var info = files_manifest[name]
+      if (info && info.hash == file.hash) {
+        files_content[name] = new Uint8Array(file.content)
+      }
+    }
+    return WebAssembly.instantiate(entry.module, functions)
+      .then(function(result) {
+        // A Module gives an Instance, bytes give { module, instance }.
+        instance = result.instance || result
+        return true
+      })
+  })
+}
+
+function cache_store(cache, module) {
+  // The files not loaded yet will be downloaded on the next visit too.
+  var entry = { hash: files_hash, module: module, files: {} }
+  files.forEach(function(name) {
+    var info = files_manifest[name]
+    if (info && files_content[name]) {
+      entry.files[name] = {
+        hash: info.hash,
+        content: files_content[name].buffer
+      }
+    }
+  })
+  return cache.put(cache_key(), entry).catch(function(e) {
+    // Most browsers can't store compiled modules (DataCloneError).
+    debug('caching the compiled code failed (' + e + '), caching bytes')
+    return fetch_buffer('index.wasm').then(function(buf) {
+      entry.module = buf
+      return cache.put(cache_key(), entry)
+    })
+  })
+}
+
+// The files mapped in the memory of `snapshot' (see files_mapped), if it
+// matches this build.
+function snapshot_files_mapped(snapshot) {
+  var state = snapshot ? snapshot_header(snapshot) : undefined
+  return state ? state.files_mapped : {}
+}
+
+// The assemblies are downloaded while the code compiles, the eager ones being
+// waited for. The ones mapped in the memory of a matching snapshot (see
+// files_mapped) aren't, which is only known once `snapshot_promise' resolves:
+// if restoring it fails after all, booting loads them when opening them (see
+// file_content()).
+function network_load(snapshot_promise) {
+  var module = undefined
+  var promises = [wasm_instantiate('index.wasm').then(function(result) {
+    instance = result.instance
+    module = result.module
+  })]
+  promises.push(snapshot_promise.then(function(snapshot) {
+    var mapped = snapshot_files_mapped(snapshot)
+    files_prefetch(function(url) {
+      return file_is_eager(url) || mapped[url]
+    })
+    return Promise.all(files.filter(function(url) {
+      return file_is_eager(url) && !mapped[url]
+    }).map(function(url) {
+      return timeline_phase('download ' + url, function() {
+        return fetch_buffer(url)
+      }).then(function(buf) {
+        file_loaded(url, new Uint8Array(buf))
+      })
+    }))
+  }))
+  return Promise.all(promises).then(function() {
+    return module
+  })
+}
+
+if (browser_environment) {
+  // Downloaded alongside the rest, a missing snapshot just means booting.
+  var snapshot_promise = snapshot_file
+    ? timeline_phase('download ' + snapshot_file, function() {
+        return fetch_buffer(snapshot_file)
+      }).catch(function(e) {
+        debug('loading the snapshot failed: ' + e)
+      })
+    : Promise.resolve(undefined)
+  var cache = undefined
+  cache_open().catch(function(e) {
+    debug('opening the cache failed: ' + e)
+  }).then(function(c) {
+    cache = c
+    return cache ? timeline_phase('cache load', function() {
+      return cache_load(cache)
+    }).catch(function(e) {
+      debug('loading from the cache failed: ' + e)
+      return false
+    }) : false
+  }).then(function(loaded) {
+    if (loaded) {
+      // For the files that the cache didn't have.
+      snapshot_promise.then(function(snapshot) {
+        var mapped = snapshot_files_mapped(snapshot)
+        files_prefetch(function(url) {
+          return mapped[url]
         })
-      );
-    });
-    Promise.all(files_promises).then(function() {
-      run_wasm_code();
-      document.dispatchEvent(new Event('WebAssemblyContentLoaded'));
-    });
+      })
+      return
+    }
+    return network_load(snapshot_promise).then(function(module) {
+      if (cache) {
+        // Not waited for, this doesn't delay Main().
+        cache_store(cache, module).catch(function(e) {
+          debug('caching failed: ' + e)
+        })
+      }
+    })
+  }).then(function() {
+    return snapshot_promise
+  }).then(function(snapshot) {
+    run_wasm_code(snapshot);
+    document.dispatchEvent(new Event('WebAssemblyContentLoaded'));
   })
 }
 else {
-  var module = new WebAssembly.Module(read('index.wasm', 'binary'))
-  instance = new WebAssembly.Instance(module, functions)
-  run_wasm_code()
+  // JS shells (d8, or node, which doesn't have their functions) take the
+  // script arguments after `--'.
+  var shell_arguments = []
+  if (typeof process != "undefined") {
+    var fs = require('fs')
+    read = function(path, type) {
+      return type == 'binary' ? new Uint8Array(fs.readFileSync(path))
+        : fs.readFileSync(path, 'utf8')
+    }
+    readbuffer = function(path) {
+      return new Uint8Array(fs.readFileSync(path)).buffer
+    }
+    print = console.log
+    shell_arguments = process.argv.slice(2)
+  }
+  else if (typeof arguments != "undefined") {
+    shell_arguments = arguments
+  }
+
+  function shell_write_file(path, bytes) {
+    if (typeof fs == "undefined") {
+      error("writing `" + path + "' requires node as the JS shell")
+      return false
+    }
+    fs.writeFileSync(path, bytes)
+    return true
+  }
+
+  timeline_phase('compile index.wasm', function() {
+    var module = new WebAssembly.Module(read('index.wasm', 'binary'))
+    instance = new WebAssembly.Instance(module, functions)
+  })
+  if (Array.prototype.indexOf.call(shell_arguments, '--snapshot') != -1) {
+    heap_update()
+    brk_current = heap_size
+    if (!snapshot_save(snapshot_file || 'index.snapshot')
+        && typeof process != "undefined") {
+      process.exitCode = 1
+    }
+  }
+  else {
+    var snapshot = undefined
+    if (snapshot_file) {
+      try {
+        snapshot = readbuffer(snapshot_file)
+      }
+      catch (e) {
+        debug('loading the snapshot failed: ' + e)
+      }
+    }
+    run_wasm_code(snapshot)
+  }
 }
@@ -2,19 +2,40 @@
 // Licensed under the MIT License. See the LICENSE.txt file in the project root
 // for the license information.
 
-#include <mach/mach_time.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <libgen.h>
+#include <spawn.h>
 
 #include <string>
 #include <vector>
 #include <memory>
-
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <set>
+#include <algorithm>
+
+#include "llvm/Analysis/ModuleSummaryAnalysis.h"
 #include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
 #include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/Bitcode/BitcodeReader.h"
 #include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/CodeGen/ParallelCG.h"
+#include "llvm/Config/llvm-config.h"
 #include "llvm/IR/AutoUpgrade.h"
 #include "llvm/IR/DiagnosticInfo.h"
 #include "llvm/IR/DiagnosticPrinter.h"
@@ -26,10 +47,13 @@
 #include "llvm/IRReader/IRReader.h"
 #include "llvm/Linker/Linker.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Error.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/Path.h"
 #include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/SHA1.h"
 #include "llvm/Support/Signals.h"
 #include "llvm/Support/SourceMgr.h"
 #include "llvm/Support/SystemUtils.h"
@@ -37,8 +61,10 @@
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Support/ToolOutputFile.h"
 #include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/IPO.h"
 #include "llvm/Transforms/IPO/FunctionImport.h"
 #include "llvm/Transforms/IPO/Internalize.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Transforms/Utils/FunctionImportUtils.h"
 
 #include "lld/Common/Driver.h"
@@ -87,18 +113,35 @@ timespec_cmp (struct timespec a, struct timespec b)
                 ? 1 : a.tv_nsec - b.tv_nsec);
 }
 
-#define FILE_IS_OLDER(source_path, dest_path) \
-    ({ \
-        struct stat source_s; \
-        assert(stat(source_path, &source_s) == 0); \
-        struct stat dest_s; \
-        stat(dest_path, &dest_s) == 0 \
-            ? timespec_cmp(source_s.st_mtimespec, dest_s.st_mtimespec) > 0 \
-            : true; \
-    })
+#if defined(__APPLE__)
+# define ST_MTIME(s) ((s).st_mtimespec)
+#else
+# define ST_MTIME(s) ((s).st_mtim)
+#endif
 
 static char libdir_path[PATH_MAX] = { 0 };
 static char bindir_path[PATH_MAX] = { 0 };
+static char monoc_path[PATH_MAX] = { 0 };
+static char cache_path[PATH_MAX] = { 0 };
+
+// A runtime object generated at the given key (see wasm_codegen_key()).
+struct resident_object {
+    std::string key;
+    std::unique_ptr<llvm::MemoryBuffer> buffer;
+};
+
+// State that the compile server (see server_main()) keeps in memory between
+// builds, and that the processes it forks for each of them inherit. Empty
+// when running as a regular command.
+static struct {
+    std::mutex lock;
+    llvm::LLVMContext *context = NULL;
+    std::string runtime_path;
+    struct stat runtime_stat;
+    std::string runtime_hash;
+    std::unique_ptr<llvm::Module> runtime_module;
+    std::map<int, resident_object> runtime_objects;
+} resident;
 
 static void
 setup_paths(const char *arg0)
@@ -115,6 +158,640 @@ setup_paths(const char *arg0)
         ERROR("can't resolve `bin' directory\n");
     }
     DIR_MUST_EXIST(bindir_path);
+
+    snprintf(monoc_path, sizeof monoc_path, "%s/monoc", bindir_path);
+    FILE_MUST_EXIST(monoc_path);
+}
+
+// Monotonic time, in nanoseconds.
+static uint64_t
+time_now(void)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double
+time_seconds(uint64_t delta)
+{
+    return delta / 1000000000.0;
+}
+
+// Build trace (see the `--trace' option). Every build step records an event
+// with its duration, the resident memory when it ends (where the system tells
+// it) and the peak resident memory of the build so far, and the events are
+// written at the end of the build in the Chrome trace event format, which
+// chrome://tracing or https://ui.perfetto.dev can display.
+
+struct trace_event {
+    const char *category;
+    std::string name;
+    unsigned thread;
+    uint64_t start;
+    uint64_t end;
+    long rss;               // KB, this process at the end, or -1
+    long peak_rss;          // KB, this process since the build started
+    long children_peak_rss; // KB, largest of the child processes (monoc...)
+};
+
+static struct {
+    const char *path = NULL;
+    std::mutex lock;
+    std::vector<trace_event> events;
+    std::map<std::thread::id, unsigned> threads;
+    uint64_t start = 0;
+} trace;
+
+static void
+trace_init(const char *path)
+{
+    trace.path = path;
+    trace.start = time_now();
+}
+
+static long
+peak_rss_get(int who)
+{
+    struct rusage usage;
+    if (getrusage(who, &usage) != 0) {
+        return 0;
+    }
+#if defined(__APPLE__)
+    return usage.ru_maxrss / 1024; // bytes
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+// The peak from getrusage() only ever grows over the build, so the current
+// resident memory is what tells how much a step used. Returns -1 where it
+// isn't available (on Linux it is).
+static long
+rss_get(void)
+{
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (file == NULL) {
+        return -1;
+    }
+    long size = 0, resident = -1;
+    if (fscanf(file, "%ld %ld", &size, &resident) != 2) {
+        resident = -1;
+    }
+    fclose(file);
+    return resident < 0 ? -1 : resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Records a step which started at `start' (see time_now()) and just ended.
+// Can be called from multiple threads at the same time.
+static void
+trace_add(const char *category, const std::string &name, uint64_t start)
+{
+    if (trace.path == NULL) {
+        return;
+    }
+
+    trace_event event;
+    event.category = category;
+    event.name = name;
+    event.start = start;
+    event.end = time_now();
+    event.rss = rss_get();
+    event.peak_rss = peak_rss_get(RUSAGE_SELF);
+    event.children_peak_rss = peak_rss_get(RUSAGE_CHILDREN);
+
+    std::lock_guard<std::mutex> guard(trace.lock);
+    auto thread = trace.threads.insert(std::make_pair(
+                std::this_thread::get_id(), trace.threads.size()));
+    event.thread = thread.first->second;
+    trace.events.push_back(event);
+}
+
+static std::string
+json_escape(const std::string &str)
+{
+    std::string escaped;
+    for (auto c : str) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        }
+        else if ((unsigned char)c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof buf, "\\u%04x", c);
+            escaped += buf;
+        }
+        else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+static void
+trace_write(void)
+{
+    if (trace.path == NULL) {
+        return;
+    }
+
+    FILE *file = fopen(trace.path, "w");
+    if (file == NULL) {
+        ERROR("can't open trace file `%s': %s\n", trace.path,
+                strerror(errno));
+    }
+
+    std::lock_guard<std::mutex> guard(trace.lock);
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1," \
+            "\"args\":{\"name\":\"mono-wasm\"}}");
+    for (auto &thread : trace.threads) {
+        fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\"," \
+                "\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}",
+                thread.second, thread.second);
+    }
+    for (auto &event : trace.events) {
+        fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\"," \
+                "\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f," \
+                "\"args\":{",
+                json_escape(event.name).c_str(), event.category,
+                event.thread, (event.start - trace.start) / 1000.0,
+                (event.end - event.start) / 1000.0);
+        if (event.rss >= 0) {
+            fprintf(file, "\"rss_at_end_kb\":%ld,", event.rss);
+        }
+        fprintf(file, "\"peak_rss_so_far_kb\":%ld," \
+                "\"children_peak_rss_so_far_kb\":%ld}}",
+                event.peak_rss, event.children_peak_rss);
+        // Also as counters, so that memory shows up as a graph.
+        if (event.rss >= 0) {
+            fprintf(file, ",\n{\"name\":\"RSS (KB)\",\"ph\":\"C\"," \
+                    "\"pid\":1,\"ts\":%.3f,\"args\":{\"self\":%ld}}",
+                    (event.end - trace.start) / 1000.0, event.rss);
+        }
+        fprintf(file, ",\n{\"name\":\"peak RSS so far (KB)\",\"ph\":\"C\"," \
+                "\"pid\":1,\"ts\":%.3f,\"args\":{\"self\":%ld," \
+                "\"children\":%ld}}",
+                (event.end - trace.start) / 1000.0, event.peak_rss,
+                event.children_peak_rss);
+    }
+    fprintf(file, "\n]}\n");
+
+    if (fclose(file) != 0) {
+        ERROR("can't write trace file `%s': %s\n", trace.path,
+                strerror(errno));
+    }
+}
+
+// The build steps are scheduled as a graph of tasks. A task runs on one of
+// the worker threads as soon as all the tasks it depends on are done, so that
+// independent steps (e.g. compiling an assembly while another one is being
+// stripped) overlap. A running task may add new tasks, which is how the steps
+// that depend on the list of linked assemblies get created.
+
+#define TASK_NONE ((size_t)-1)
+
+// Returns false on failure, with a message set in `error'.
+typedef std::function<bool(std::string &error)> task_func;
+
+struct task {
+    std::string name;
+    task_func func;
+    std::vector<size_t> deps;
+    std::vector<size_t> dependents;
+    size_t deps_left = 0;
+    bool done = false;
+    uint64_t start = 0;
+    uint64_t end = 0;
+};
+
+struct task_graph {
+    std::mutex lock;
+    std::condition_variable cond;
+    std::vector<std::unique_ptr<task>> tasks;
+    std::deque<size_t> ready;
+    size_t pending = 0;
+    size_t running = 0;
+    bool failed = false;
+    std::string error;
+    bool verbose = false;
+};
+
+static size_t
+task_add(task_graph &graph, std::string name, std::vector<size_t> deps,
+        task_func func)
+{
+    std::lock_guard<std::mutex> guard(graph.lock);
+
+    size_t id = graph.tasks.size();
+    auto t = llvm::make_unique<task>();
+    t->name = name;
+    t->func = func;
+    for (auto dep : deps) {
+        if (dep == TASK_NONE) {
+            continue;
+        }
+        t->deps.push_back(dep);
+        if (!graph.tasks[dep]->done) {
+            graph.tasks[dep]->dependents.push_back(id);
+            t->deps_left++;
+        }
+    }
+    if (t->deps_left == 0) {
+        graph.ready.push_back(id);
+    }
+    graph.tasks.push_back(std::move(t));
+    graph.pending++;
+    graph.cond.notify_all();
+
+    return id;
+}
+
+// Runs all the tasks over `njobs' threads (the calling thread being one of
+// them). On failure no new task is started, and false is returned once the
+// running ones are done.
+static bool
+tasks_run(task_graph &graph, unsigned njobs)
+{
+    auto worker = [&]() {
+        std::unique_lock<std::mutex> guard(graph.lock);
+        while (true) {
+            while (graph.ready.empty() && graph.pending > 0
+                    && !graph.failed) {
+                graph.cond.wait(guard);
+            }
+            if (graph.failed || graph.pending == 0) {
+                break;
+            }
+            auto t = graph.tasks[graph.ready.front()].get();
+            graph.ready.pop_front();
+            graph.running++;
+            guard.unlock();
+
+            std::string error;
+            t->start = time_now();
+            bool ok = t->func(error);
+            t->end = time_now();
+            trace_add("step", t->name, t->start);
+
+            guard.lock();
+            if (graph.verbose) {
+                printf("%s ... %.3fs\n", t->name.c_str(),
+                        time_seconds(t->end - t->start));
+            }
+            t->done = true;
+            graph.pending--;
+            graph.running--;
+            if (!ok && !graph.failed) {
+                graph.failed = true;
+                graph.error = t->name + ": " + error;
+            }
+            for (auto dependent : t->dependents) {
+                if (--graph.tasks[dependent]->deps_left == 0) {
+                    graph.ready.push_back(dependent);
+                }
+            }
+            graph.cond.notify_all();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < njobs; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    return !graph.failed;
+}
+
+// Returns how many of the `njobs' threads of tasks_run() aren't running a task,
+// for a task to use them for its own threads. Tasks that become ready later
+// may still run alongside them.
+static unsigned
+tasks_idle_count(task_graph &graph, unsigned njobs)
+{
+    std::lock_guard<std::mutex> guard(graph.lock);
+    return graph.running < njobs ? njobs - graph.running : 0;
+}
+
+// Prints the chain of dependent tasks which took the longest, as the build
+// can't be faster than it however many jobs are used.
+static void
+tasks_critical_path_print(task_graph &graph)
+{
+    // Dependencies are always added before their dependents.
+    size_t count = graph.tasks.size();
+    std::vector<uint64_t> path_time(count, 0);
+    std::vector<size_t> path_prev(count, TASK_NONE);
+    size_t last = TASK_NONE;
+    for (size_t i = 0; i < count; i++) {
+        auto &t = graph.tasks[i];
+        for (auto dep : t->deps) {
+            if (path_time[dep] > path_time[i]) {
+                path_time[i] = path_time[dep];
+                path_prev[i] = dep;
+            }
+        }
+        path_time[i] += t->end - t->start;
+        if (last == TASK_NONE || path_time[i] > path_time[last]) {
+            last = i;
+        }
+    }
+    if (last == TASK_NONE) {
+        return;
+    }
+
+    std::vector<size_t> path;
+    for (size_t i = last; i != TASK_NONE; i = path_prev[i]) {
+        path.push_back(i);
+    }
+    printf("critical path (%.3fs):\n", time_seconds(path_time[last]));
+    for (auto i = path.rbegin(); i != path.rend(); ++i) {
+        auto &t = graph.tasks[*i];
+        printf("    %s ... %.3fs\n", t->name.c_str(),
+                time_seconds(t->end - t->start));
+    }
+}
+
+// Build artifacts (bitcode and wasm object files) are stored in the cache
+// directory under a hash of everything they are generated from, rather than
+// next to their sources, so that lookups don't depend on modification times
+// and so that the directory can be shared between build machines.
+
+// Part of every cache key. It must be bumped whenever a change to the driver
+// changes the artifacts it generates, so that their older versions are no
+// longer used.
+#define CACHE_VERSION "2"
+
+// The default size limit of the cache, past which builds remove its least
+// recently used entries (see the `--cache-size' option).
+#define CACHE_MAX_SIZE (2048ULL * 1024 * 1024)
+
+static void
+cache_setup(const char *path)
+{
+    auto EC = llvm::sys::fs::create_directories(path);
+    if (EC) {
+        ERROR("can't create cache directory `%s': %s\n", path,
+                EC.message().c_str());
+    }
+    if (realpath(path, cache_path) == NULL) {
+        ERROR("can't resolve cache directory `%s'\n", path);
+    }
+}
+
+// The functions below may run in build tasks, so they report failures to the
+// caller (in `error') instead of exiting.
+
+// Like the _PATH_CHECK() macros: sets `exists', and fails if `path' exists
+// but isn't of type `iftype'.
+static bool
+path_may_exist(const std::string &path, mode_t iftype, const char *what,
+        bool &exists, std::string &error)
+{
+    struct stat s;
+    exists = false;
+    if (stat(path.c_str(), &s) != 0) {
+        return true;
+    }
+    if ((s.st_mode & S_IFMT) != iftype) {
+        error = "path `" + path + "' is not a " + what;
+        return false;
+    }
+    exists = true;
+    return true;
+}
+
+static bool
+file_may_exist(const std::string &path, bool &exists, std::string &error)
+{
+    return path_may_exist(path, S_IFREG, "file", exists, error);
+}
+
+static bool
+dir_may_exist(const std::string &path, bool &exists, std::string &error)
+{
+    return path_may_exist(path, S_IFDIR, "directory", exists, error);
+}
+
+extern char **environ;
+
+// Runs the command `args' (looked up in PATH, like the shell would), with the
+// `NAME=value' variables of `env' set in its environment, and waits for it.
+// Build tasks run commands concurrently, which system() isn't required to
+// support. The output of the command is discarded if `quiet' is set.
+static bool
+command_run(const std::vector<std::string> &args,
+        const std::vector<std::string> &env, bool quiet, std::string &error)
+{
+    std::string cmd;
+    std::vector<char *> argv;
+    for (auto &arg : args) {
+        cmd += (cmd.empty() ? "" : " ") + arg;
+        argv.push_back((char *)arg.c_str());
+    }
+    argv.push_back(NULL);
+
+    std::vector<char *> envp;
+    for (auto &var : env) {
+        envp.push_back((char *)var.c_str());
+    }
+    for (char **var = environ; *var != NULL; var++) {
+        size_t name_len = strcspn(*var, "=") + 1;
+        bool overridden = false;
+        for (auto &set_var : env) {
+            if (strncmp(set_var.c_str(), *var, name_len) == 0) {
+                overridden = true;
+                break;
+            }
+        }
+        if (!overridden) {
+            envp.push_back(*var);
+        }
+    }
+    envp.push_back(NULL);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (quiet) {
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+                O_WRONLY, 0);
+        posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO,
+                STDERR_FILENO);
+    }
+    pid_t pid;
+    int err = posix_spawnp(&pid, argv[0], &actions, NULL, argv.data(),
+            envp.data());
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0) {
+        error = "can't run `" + cmd + "': " + strerror(err);
+        return false;
+    }
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            error = "waiting for `" + cmd + "' failed: " + strerror(errno);
+            return false;
+        }
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        error = "command failed: " + cmd;
+        return false;
+    }
+    return true;
+}
+
+// Sets `older' if `dest_path' doesn't exist or was modified before
+// `source_path'.
+static bool
+file_is_older(const std::string &source_path, const std::string &dest_path,
+        bool &older, std::string &error)
+{
+    struct stat source_s;
+    if (stat(source_path.c_str(), &source_s) != 0) {
+        error = "can't stat `" + source_path + "': " + strerror(errno);
+        return false;
+    }
+    struct stat dest_s;
+    older = stat(dest_path.c_str(), &dest_s) == 0
+        ? timespec_cmp(ST_MTIME(source_s), ST_MTIME(dest_s)) > 0
+        : true;
+    return true;
+}
+
+// Returns an empty string on failure.
+static std::string
+file_hash(const std::string &path, std::string &error)
+{
+    if (!resident.runtime_hash.empty() && path == resident.runtime_path) {
+        return resident.runtime_hash;
+    }
+
+    auto buffer = llvm::MemoryBuffer::getFile(path);
+    if (!buffer) {
+        error = "can't read `" + path + "': "
+            + buffer.getError().message();
+        return "";
+    }
+    llvm::SHA1 hasher;
+    hasher.update((*buffer)->getBuffer());
+    return llvm::toHex(hasher.final());
+}
+
+static std::string
+cache_key(const std::vector<std::string> &parts)
+{
+    llvm::SHA1 hasher;
+    for (auto part : parts) {
+        hasher.update(part);
+        hasher.update(llvm::StringRef("", 1));
+    }
+    return llvm::toHex(hasher.final());
+}
+
+static std::string
+cache_entry_path(const std::string &key, const char *extension)
+{
+    return std::string(cache_path) + "/" + key + extension;
+}
+
+// Like file_may_exist(), but also marks an existing entry as recently used, for
+// cache_prune().
+static bool
+cache_entry_exists(const std::string &path, bool &exists, std::string &error)
+{
+    if (!file_may_exist(path, exists, error)) {
+        return false;
+    }
+    if (exists) {
+        utimes(path.c_str(), NULL);
+    }
+    return true;
+}
+
+// Returns the path of a new temporary file in the cache, in which an artifact
+// can be written before being committed with cache_commit(), or an empty
+// string on failure.
+static std::string
+cache_temp_path(const std::string &key, std::string &error)
+{
+    llvm::SmallString<PATH_MAX> path;
+    auto EC = llvm::sys::fs::createUniqueFile(
+            std::string(cache_path) + "/" + key + "-%%%%%%.tmp", path);
+    if (EC) {
+        error = std::string("can't create temporary file in `") + cache_path
+            + "': " + EC.message();
+        return "";
+    }
+    return path.str().str();
+}
+
+// Renaming is atomic, so concurrent builds sharing the cache never see a
+// partially written artifact.
+static bool
+cache_commit(const std::string &temp_path, const std::string &path,
+        std::string &error)
+{
+    if (rename(temp_path.c_str(), path.c_str()) != 0) {
+        error = "can't rename `" + temp_path + "' to `" + path + "': "
+            + strerror(errno);
+        unlink(temp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Removes the least recently used entries of the cache until it takes at most
+// `max_size' bytes. Entries are marked as used when they are committed and
+// when a build finds them, so the ones of the last build are removed last.
+// Failures are ignored, as a concurrent build may be removing the same files.
+static void
+cache_prune(uint64_t max_size, bool verbose)
+{
+    DIR *dir = opendir(cache_path);
+    if (dir == NULL) {
+        return;
+    }
+    std::vector<std::pair<struct timespec, std::string>> entries;
+    std::map<std::string, off_t> sizes;
+    uint64_t total_size = 0;
+    struct dirent *dirent;
+    while ((dirent = readdir(dir)) != NULL) {
+        auto path = std::string(cache_path) + "/" + dirent->d_name;
+        struct stat s;
+        if (stat(path.c_str(), &s) != 0 || !S_ISREG(s.st_mode)
+                || llvm::StringRef(dirent->d_name).endswith(".tmp")) {
+            continue;
+        }
+        entries.push_back({ ST_MTIME(s), path });
+        sizes[path] = s.st_size;
+        total_size += s.st_size;
+    }
+    closedir(dir);
+
+    std::sort(entries.begin(), entries.end(),
+            [](const std::pair<struct timespec, std::string> &a,
+                const std::pair<struct timespec, std::string> &b) {
+                return timespec_cmp(a.first, b.first) < 0;
+            });
+    unsigned removed = 0;
+    uint64_t removed_size = 0;
+    for (auto &entry : entries) {
+        if (total_size - removed_size <= max_size) {
+            break;
+        }
+        if (unlink(entry.second.c_str()) == 0) {
+            removed++;
+            removed_size += sizes[entry.second];
+        }
+    }
+    if (verbose && removed > 0) {
+        printf("cache ... removed %u entries (%.1f MB)\n", removed,
+                removed_size / (1024.0 * 1024.0));
+    }
 }
 
 static void
@@ -136,18 +813,25 @@ diagnostic_handler(const llvm::DiagnosticInfo &DI, void *ctx)
     llvm::errs() << '\n';
 }
 
-static void
+static bool
 assembly_link(std::vector<std::string> &assembly_paths,
-        const char *output_path)
+        const char *output_path, std::string &error)
 {
     auto dest_base = std::string(output_path) + "/";
 
-    if (DIR_MAY_EXIST(output_path)) {
+    bool output_exists = false;
+    if (!dir_may_exist(output_path, output_exists, error)) {
+        return false;
+    }
+    if (output_exists) {
         bool need_link = false;
         for (auto assembly_path : assembly_paths) {
             auto linked_path = dest_base + assembly_path;
-            if (FILE_IS_OLDER(assembly_path.c_str(), linked_path.c_str())) {
-                need_link = true;
+            if (!file_is_older(assembly_path, linked_path, need_link,
+                        error)) {
+                return false;
+            }
+            if (need_link) {
                 break;
             }
         }
@@ -156,25 +840,28 @@ assembly_link(std::vector<std::string> &assembly_paths,
         }
     }
 
-    char cmd[PATH_MAX];
-    snprintf(cmd, sizeof cmd, "monolinker -d %s -c link -l none -o %s",
-            libdir_path, output_path);
-
-    for (auto assembly_path : assembly_paths) {
-        strlcat(cmd, " -a ", sizeof cmd);
-        strlcat(cmd, assembly_path.c_str(), sizeof cmd);
-    }
-
-    if (system(cmd) != 0) {
-        ERROR("monolinker pass failed (command was: %s)\n", cmd);
+    {
+        std::vector<std::string> args = { "monolinker", "-d", libdir_path,
+            "-c", "link", "-l", "none", "-o", output_path };
+        for (auto assembly_path : assembly_paths) {
+            args.push_back("-a");
+            args.push_back(assembly_path);
+        }
+        if (!command_run(args, {}, false, error)) {
+            error = "monolinker pass failed: " + error;
+            return false;
+        }
     }
 
 skip_link:
-    char *first_assembly = strdup(basename((char *)assembly_paths[0].c_str()));
-    assert(first_assembly != NULL);
-    assembly_paths.clear();
     DIR *dir = opendir(output_path);
-    assert(dir != NULL);
+    if (dir == NULL) {
+        error = std::string("can't open `") + output_path + "': "
+            + strerror(errno);
+        return false;
+    }
+    std::string first_assembly = basename((char *)assembly_paths[0].c_str());
+    assembly_paths.clear();
     struct dirent *entry;
     int i = 0, first_assembly_i = -1;
     while ((entry = readdir(dir)) != NULL) {
@@ -185,7 +872,7 @@ skip_link:
             if (strcmp(sp, ".exe") == 0 || strcmp(sp, ".dll") == 0) {
                 auto linked_path = dest_base + s;
                 assembly_paths.push_back(linked_path);
-                if (strcmp(s, first_assembly) == 0) {
+                if (first_assembly == s) {
                     first_assembly_i = i;
                 }
                 i++;
@@ -194,66 +881,159 @@ skip_link:
     }
     closedir(dir);
     // The first assembly path must remain the same given to the command line.
-    assert (first_assembly_i >= 0);
+    if (first_assembly_i < 0) {
+        error = "`" + first_assembly + "' is missing from `" + output_path
+            + "' after linking";
+        return false;
+    }
     if (first_assembly_i > 0) {
         std::iter_swap(assembly_paths.begin() + first_assembly_i,
                 assembly_paths.begin());
     }
-    free(first_assembly);
+    return true;
 }
 
-static std::string
+#define MONOC_AOT_OPTIONS "asmonly,llvmonly,static"
+
+// The bitcode of an assembly depends on the compiler and on the assemblies it
+// references. The latter are not tracked individually, so each assembly is
+// keyed on all of them, except mscorlib which references nothing and can then
+// be reused across applications.
+static bool
+assembly_compile_keys(std::vector<std::string> &assembly_paths,
+        std::vector<std::string> &keys, std::string &error)
+{
+    std::vector<std::string> hashes;
+    for (auto assembly_path : assembly_paths) {
+        hashes.push_back(file_hash(assembly_path, error));
+        if (hashes.back().empty()) {
+            return false;
+        }
+    }
+    auto monoc_hash = file_hash(monoc_path, error);
+    if (monoc_hash.empty()) {
+        return false;
+    }
+    // The generated code calls into the runtime and depends on its
+    // structures, which monoc doesn't embed, so a runtime built from another
+    // Mono version must invalidate the bitcode too.
+    auto runtime_hash = file_hash(std::string(libdir_path) + "/runtime.bc",
+            error);
+    if (runtime_hash.empty()) {
+        return false;
+    }
+
+    keys.clear();
+    for (int i = 0; i < assembly_paths.size(); i++) {
+        std::vector<std::string> key_parts;
+        key_parts.push_back("bc");
+        key_parts.push_back(CACHE_VERSION);
+        key_parts.push_back(monoc_hash);
+        key_parts.push_back(runtime_hash);
+        key_parts.push_back(MONOC_AOT_OPTIONS);
+        key_parts.push_back(hashes[i]);
+        const char *base = strrchr(assembly_paths[i].c_str(), '/');
+        if (strcmp(base + 1, "mscorlib.dll") != 0) {
+            key_parts.insert(key_parts.end(), hashes.begin(), hashes.end());
+        }
+        keys.push_back(cache_key(key_parts));
+    }
+    return true;
+}
+
+// Called from multiple threads at the same time, so it reports failures to
+// the caller (in `error') instead of exiting. `key' identifies the generated
+// bitcode in the cache, whose path is set in `bitcode_path'.
+static bool
 assembly_compile(std::string assembly_path, const char *build_dir,
-        std::string bitcode_path)
+        std::string key, std::string &bitcode_path, std::string &error)
 {
-    static char monoc_path[PATH_MAX] = { '\0' };
-    if (monoc_path[0] == '\0') {
-        snprintf(monoc_path, sizeof monoc_path, "%s/monoc", bindir_path);
-        FILE_MUST_EXIST(monoc_path);
+    bitcode_path = cache_entry_path(key, ".bc");
+    bool exists = false;
+    if (!cache_entry_exists(bitcode_path, exists, error)) {
+        return false;
     }
+    if (!exists) {
+        uint64_t start = time_now();
+        auto temp_path = cache_temp_path(key, error);
+        if (temp_path.empty()) {
+            return false;
+        }
 
-    if (FILE_IS_OLDER(assembly_path.c_str(), bitcode_path.c_str())) {
-        char cmd[PATH_MAX];
-        snprintf(cmd, sizeof cmd,
-                "MONO_PATH=\"%s\" MONO_ENABLE_COOP=1 " \
-                "%s --aot=asmonly,llvmonly,static,llvm-outfile=%s %s " \
-                ">& /dev/null",
-                build_dir, monoc_path, bitcode_path.c_str(),
-                assembly_path.c_str());
+        if (!command_run({ monoc_path,
+                    "--aot=" MONOC_AOT_OPTIONS ",llvm-outfile=" + temp_path,
+                    assembly_path },
+                    { std::string("MONO_PATH=") + build_dir,
+                    "MONO_ENABLE_COOP=1" }, true, error)) {
+            unlink(temp_path.c_str());
+            error = "bitcode compilation for `" + assembly_path + "' failed: "
+                + error;
+            return false;
+        }
 
-        if (system(cmd) != 0) {
-            ERROR("bitcode compilation for `%s' failed " \
-                    "(command was: %s)\n", assembly_path.c_str(), cmd);
+        if (!cache_commit(temp_path, bitcode_path, error)) {
+            return false;
         }
+        trace_add("monoc", assembly_path, start);
     }
 
-    return bitcode_path;
+    return true;
 }
 
+// Bitcode files are loaded lazily: function bodies are only read when the
+// linker pulls them in (see bitcode_link()). Returns NULL on failure.
 static std::unique_ptr<llvm::Module>
-bitcode_link(std::vector<std::string> &paths, llvm::LLVMContext &context)
+bitcode_load(const std::string &path, llvm::LLVMContext &context,
+        std::string &error)
 {
-    auto module = llvm::make_unique<llvm::Module>("index.bc", context);
-    llvm::Linker linker(*module);
-
-    for (auto path : paths) {
-        llvm::SMDiagnostic err;
-        auto file_module = llvm::parseIRFile(path, err, context);
-        if (!file_module) {
-            ERROR("bitcode parsing error: %s:%d: %s\n",
-                    err.getFilename().str().c_str(), err.getLineNo(),
-                    err.getMessage().str().c_str());
-        }
+    // The compile server keeps the runtime module parsed in its context.
+    if (resident.runtime_module && path == resident.runtime_path
+            && &resident.runtime_module->getContext() == &context) {
+        return std::move(resident.runtime_module);
+    }
 
-        if (linker.linkInModule(std::move(file_module),
-                    llvm::Linker::Flags::OverrideFromSrc)) {
-            ERROR("linking %s failed\n", path.c_str());
-        }
+    uint64_t start = time_now();
+    llvm::SMDiagnostic err;
+    auto module = llvm::getLazyIRFileModule(path, err, context);
+    if (!module) {
+        error = "bitcode parsing error: " + err.getFilename().str() + ":"
+            + std::to_string(err.getLineNo()) + ": " + err.getMessage().str();
+        return NULL;
     }
+    trace_add("parse", path, start);
 
     return module;
 }
 
+static bool
+bitcode_link_module(llvm::Linker &linker, const std::string &path,
+        std::unique_ptr<llvm::Module> module, unsigned flags,
+        std::string &error)
+{
+    uint64_t start = time_now();
+    // The source module is freed once linked.
+    if (linker.linkInModule(std::move(module), flags)) {
+        error = "linking " + path + " failed";
+        return false;
+    }
+    trace_add("link", path, start);
+    return true;
+}
+
+// /<build-dir>/foo.{exe,dll} -> mono_aot_module_foo_info
+static std::string
+aot_module_info_name(const std::string &path)
+{
+    assert(path.size() > 4);
+    assert(path[path.size() - 4] == '.');
+    size_t beg = path.rfind('/');
+    assert(beg != std::string::npos);
+    beg++;
+
+    return std::string("mono_aot_module_")
+        + path.substr(beg, path.size() - beg - 4) + "_info";
+}
+
 static llvm::Module *
 aot_init_gen(std::vector<std::string> &assembly_paths, llvm::Module *module,
         llvm::LLVMContext &context)
@@ -280,15 +1060,7 @@ aot_init_gen(std::vector<std::string> &assembly_paths, llvm::Module *module,
     auto bb = llvm::BasicBlock::Create(context, "entry", f);
 
     for (auto path : assembly_paths) {
-        // /<build-dir>/foo.{exe,dll} -> mono_aot_module_foo_info
-        assert(path.size() > 4);
-        assert(path[path.size() - 4] == '.');
-        size_t beg = path.rfind('/');
-        assert(beg != std::string::npos);
-        beg++;
-
-        auto name = std::string("mono_aot_module_")
-            + path.substr(beg, path.size() - beg - 4) + "_info";
+        auto name = aot_module_info_name(path);
 
         auto aot_info = module->getGlobalVariable(name.c_str());
         if (aot_info == NULL) {
@@ -305,27 +1077,36 @@ aot_init_gen(std::vector<std::string> &assembly_paths, llvm::Module *module,
     return module;
 }
 
+// Must be called before any thread is started.
 static void
-wasm_codegen(llvm::Module *module, llvm::CodeGenOpt::Level opt_level,
-        llvm::LLVMContext &context, std::string wasm_path)
+wasm_target_init(void)
 {
     static bool init_done = false;
-    if (!init_done) {
-        LLVMInitializeWebAssemblyTarget();
-        LLVMInitializeWebAssemblyTargetMC();
-        LLVMInitializeWebAssemblyTargetInfo();
-        LLVMInitializeWebAssemblyAsmPrinter();
-        init_done = true;
+    if (init_done) {
+        return;
     }
+    init_done = true;
 
-    // Important to generate a proper wasm object file.
-    module->setTargetTriple("wasm32-unknown-unknown-wasm");
+    LLVMInitializeWebAssemblyTarget();
+    LLVMInitializeWebAssemblyTargetMC();
+    LLVMInitializeWebAssemblyTargetInfo();
+    LLVMInitializeWebAssemblyAsmPrinter();
+}
+
+// Important to generate a proper wasm object file.
+#define WASM_TRIPLE "wasm32-unknown-unknown-wasm"
 
+// Returns NULL on failure.
+static std::unique_ptr<llvm::TargetMachine>
+wasm_target_machine_create(llvm::CodeGenOpt::Level opt_level,
+        std::string &error)
+{
     std::string err;
-    auto triple = llvm::Triple(module->getTargetTriple());
+    auto triple = llvm::Triple(WASM_TRIPLE);
     auto target = llvm::TargetRegistry::lookupTarget("wasm32", triple, err);
     if (target == NULL) {
-        ERROR("can't lookup wasm32 target: %s\n", err.c_str());
+        error = "can't lookup wasm32 target: " + err;
+        return NULL;
     }
 
     std::string cpu_str = "";
@@ -333,12 +1114,72 @@ wasm_codegen(llvm::Module *module, llvm::CodeGenOpt::Level opt_level,
     llvm::TargetOptions options;
     options.MCOptions.AsmVerbose = false;
 
-    auto target_machine = target->createTargetMachine(triple.getTriple(),
-            cpu_str, features_str, options, llvm::None,
-            llvm::CodeModel::Large, opt_level);
+    std::unique_ptr<llvm::TargetMachine> target_machine(
+            target->createTargetMachine(triple.getTriple(), cpu_str,
+                features_str, options, llvm::None, llvm::CodeModel::Large,
+                opt_level));
+
+    if (!target_machine) {
+        error = "couldn't allocate target machine";
+    }
+
+    return target_machine;
+}
+
+// A target machine is only used by one thread at a time, so build steps
+// borrow one from this pool and give it back when done, instead of creating
+// their own. The compile server fills it at startup, so that the processes it
+// forks for each build don't have to create any.
+static struct {
+    std::mutex lock;
+    std::map<int, std::vector<std::unique_ptr<llvm::TargetMachine>>> free;
+} target_machines;
+
+struct wasm_target_machine_release {
+    llvm::CodeGenOpt::Level opt_level;
+
+    void
+    operator()(llvm::TargetMachine *target_machine) const
+    {
+        std::lock_guard<std::mutex> guard(target_machines.lock);
+        target_machines.free[opt_level].emplace_back(target_machine);
+    }
+};
+
+typedef std::unique_ptr<llvm::TargetMachine, wasm_target_machine_release>
+    wasm_target_machine_ref;
+
+// Returns NULL on failure.
+static wasm_target_machine_ref
+wasm_target_machine_get(llvm::CodeGenOpt::Level opt_level, std::string &error)
+{
+    std::unique_ptr<llvm::TargetMachine> target_machine;
+    {
+        std::lock_guard<std::mutex> guard(target_machines.lock);
+        auto &free = target_machines.free[opt_level];
+        if (!free.empty()) {
+            target_machine = std::move(free.back());
+            free.pop_back();
+        }
+    }
+    if (!target_machine) {
+        target_machine = wasm_target_machine_create(opt_level, error);
+    }
+    return wasm_target_machine_ref(target_machine.release(),
+            wasm_target_machine_release { opt_level });
+}
+
+static bool
+wasm_codegen(llvm::Module *module, llvm::CodeGenOpt::Level opt_level,
+        llvm::LLVMContext &context, std::string wasm_path, std::string &error)
+{
+    uint64_t start = time_now();
+    module->setTargetTriple(WASM_TRIPLE);
+    auto triple = llvm::Triple(module->getTargetTriple());
 
-    if (target_machine == NULL) {
-        ERROR("couldn't allocate target machine\n");
+    auto target_machine = wasm_target_machine_get(opt_level, error);
+    if (!target_machine) {
+        return false;
     }
 
     llvm::legacy::PassManager pm;
@@ -350,39 +1191,699 @@ wasm_codegen(llvm::Module *module, llvm::CodeGenOpt::Level opt_level,
     std::error_code EC;
     llvm::raw_fd_ostream dest(wasm_path, EC, llvm::sys::fs::F_None);
     if (EC) {
-        ERROR("error when opening file %s: %s\n", wasm_path.c_str(),
-                EC.message().c_str());
+        error = "error when opening file " + wasm_path + ": " + EC.message();
+        return false;
     }
 
     if (target_machine->addPassesToEmitFile(pm, dest,
                 llvm::TargetMachine::CGFT_ObjectFile)) {
-        ERROR("target does not support assembly generation\n");
+        error = "target does not support assembly generation";
+        return false;
     }
 
     pm.run(*module);
     dest.flush();
+    trace_add("codegen", module->getModuleIdentifier(), start);
+    return true;
 }
 
-static void
-wasm_codegen2(std::string &bitcode_path, llvm::CodeGenOpt::Level opt,
-        llvm::LLVMContext &context, std::string wasm_path)
+// Functions that index.js calls into. These must remain visible (and are kept
+// alive) when the whole program is stripped and optimized, so this list has
+// to be kept in sync with the `instance.exports' uses in index.js.
+static const char *js_exports[] = {
+    "free",
+    "malloc",
+    "memalign",
+    "mono_assembly_get_image",
+    "mono_class_from_name",
+    "mono_class_get_method_from_name_flags",
+    "mono_domain_get",
+    "mono_domain_get_assemblies",
+    "mono_object_unbox",
+    "mono_runtime_invoke",
+    "mono_string_new_utf16",
+    "mono_wasm_boot",
+    "mono_wasm_class_get_methods",
+    "mono_wasm_main",
+    "mono_wasm_method_get_types",
+    "mono_wasm_phase_end",
+    "mono_wasm_phase_name",
+    "mono_wasm_phase_start",
+    "mono_wasm_phases_clear",
+    "mono_wasm_phases_count",
+    "mono_wasm_run",
+    "setenv",
+};
+
+static bool
+is_js_export(llvm::StringRef name)
 {
-    if (FILE_IS_OLDER(bitcode_path.c_str(), wasm_path.c_str())) {
+    for (auto js_export : js_exports) {
+        if (name == js_export) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Adds the standard middle-end pipeline for the given levels to `pm', or its
+// ThinLTO variant when `thin_lto' is set.
+static void
+optimize_passes_add(llvm::legacy::PassManager &pm,
+        llvm::TargetMachine *target_machine,
+        llvm::CodeGenOpt::Level opt_level, unsigned size_level, bool thin_lto)
+{
+    pm.add(new llvm::TargetLibraryInfoWrapperPass(
+                llvm::TargetLibraryInfoImpl(target_machine->getTargetTriple())));
+    pm.add(llvm::createTargetTransformInfoWrapperPass(
+                target_machine->getTargetIRAnalysis()));
+
+    llvm::PassManagerBuilder builder;
+    builder.OptLevel = opt_level;
+    builder.SizeLevel = size_level;
+    builder.Inliner = llvm::createFunctionInliningPass(builder.OptLevel,
+            builder.SizeLevel, false);
+    if (thin_lto) {
+        builder.populateThinLTOPassManager(pm);
+    }
+    else {
+        builder.populateModulePassManager(pm);
+    }
+}
+
+struct module_stats {
+    unsigned functions = 0;
+    unsigned instructions = 0;
+    unsigned globals = 0;
+    uint64_t globals_size = 0;
+    unsigned imports = 0;
+};
+
+static module_stats
+module_stats_get(llvm::Module *module)
+{
+    module_stats stats;
+    auto &data_layout = module->getDataLayout();
+    for (auto &f : *module) {
+        if (f.isDeclaration()) {
+            if (!f.isIntrinsic() && !f.use_empty()) {
+                stats.imports++;
+            }
+            continue;
+        }
+        stats.functions++;
+        for (auto &bb : f) {
+            stats.instructions += bb.size();
+        }
+    }
+    for (auto &gv : module->globals()) {
+        if (!gv.isDeclaration()) {
+            stats.globals++;
+            stats.globals_size += data_layout.getTypeAllocSize(
+                    gv.getValueType());
+        }
+    }
+    return stats;
+}
+
+// Links the whole program. The assemblies are linked first, each one
+// overriding the symbols of the previous ones, then their AOT init code, then
+// only the part of the runtime which they or index.js use: runtime functions
+// that nothing references are never even read from runtime.bc, which keeps
+// the memory used by the driver down. Returns NULL on failure.
+static std::unique_ptr<llvm::Module>
+bitcode_link(std::string &runtime_path, std::vector<std::string> &paths,
+        std::vector<std::string> &assembly_paths, llvm::LLVMContext &context,
+        std::string &error)
+{
+    auto module = llvm::make_unique<llvm::Module>("index.bc", context);
+    llvm::Linker linker(*module);
+
+    for (auto path : paths) {
+        auto path_module = bitcode_load(path, context, error);
+        if (!path_module || !bitcode_link_module(linker, path,
+                    std::move(path_module),
+                    llvm::Linker::Flags::OverrideFromSrc, error)) {
+            return NULL;
+        }
+    }
+
+    aot_init_gen(assembly_paths, module.get(), context);
+
+    // The functions index.js calls are referenced by nothing else, declaring
+    // them makes the linker pull them (and what they use) from the runtime.
+    auto runtime_module = bitcode_load(runtime_path, context, error);
+    if (!runtime_module) {
+        return NULL;
+    }
+    for (auto js_export : js_exports) {
+        auto f = runtime_module->getFunction(js_export);
+        if (f != NULL) {
+            module->getOrInsertFunction(js_export, f->getFunctionType());
+        }
+    }
+    // Symbols already defined by the assemblies are not linked again, so
+    // like above they take precedence over the runtime ones.
+    if (!bitcode_link_module(linker, runtime_path, std::move(runtime_module),
+                llvm::Linker::Flags::LinkOnlyNeeded, error)) {
+        return NULL;
+    }
+
+    return module;
+}
+
+// Removes from the whole program everything that can't be reached from the
+// functions index.js calls into (mono_wasm_main being one of them) and from
+// the AOT module info symbols, which the runtime walks to find the code of
+// the assemblies. Much of libc and of the runtime (debugger agent, remoting,
+// processes, sockets, etc.) is never used and goes away here, along with
+// the imports it needed.
+static bool
+module_strip_unreachable(llvm::Module *module,
+        std::vector<std::string> &assembly_paths, bool verbose,
+        std::string &error)
+{
+    auto target_machine = wasm_target_machine_get(llvm::CodeGenOpt::None,
+            error);
+    if (!target_machine) {
+        return false;
+    }
+    module->setTargetTriple(WASM_TRIPLE);
+    module->setDataLayout(target_machine->createDataLayout());
+
+    std::set<std::string> roots;
+    for (auto js_export : js_exports) {
+        roots.insert(js_export);
+    }
+    for (auto path : assembly_paths) {
+        roots.insert(aot_module_info_name(path));
+    }
+
+    auto before = module_stats_get(module);
+
+    llvm::legacy::PassManager pm;
+    pm.add(llvm::createInternalizePass([&](const llvm::GlobalValue &gv) {
+                return roots.count(gv.getName().str()) > 0;
+            }));
+    pm.add(llvm::createGlobalDCEPass());
+    pm.run(*module);
+
+    if (verbose) {
+        auto after = module_stats_get(module);
+        printf("    removed %u of %u functions (%u of %u instructions)\n",
+                before.functions - after.functions, before.functions,
+                before.instructions - after.instructions,
+                before.instructions);
+        printf("    removed %u of %u globals (%llu of %llu bytes)\n",
+                before.globals - after.globals, before.globals,
+                (unsigned long long)(before.globals_size
+                    - after.globals_size),
+                (unsigned long long)before.globals_size);
+        printf("    removed %u of %u imports\n",
+                before.imports - after.imports, before.imports);
+    }
+    return true;
+}
+
+// Runs the middle-end pipeline on the whole program (runtime, assemblies and
+// AOT init code linked together), once module_strip_unreachable() has
+// internalized everything but its roots, so that the standard module passes
+// can inline across the runtime and the assemblies.
+static bool
+module_optimize(llvm::Module *module, llvm::CodeGenOpt::Level opt_level,
+        unsigned size_level, std::string &error)
+{
+    module->setTargetTriple(WASM_TRIPLE);
+
+    auto target_machine = wasm_target_machine_get(opt_level, error);
+    if (!target_machine) {
+        return false;
+    }
+    module->setDataLayout(target_machine->createDataLayout());
+
+    llvm::legacy::PassManager pm;
+    optimize_passes_add(pm, target_machine.get(), opt_level, size_level,
+            false);
+
+    pm.run(*module);
+    return true;
+}
+
+// Partitions `module' into `count' pieces which are code-generated in
+// parallel, each in its own LLVM context, into `<base>.<n>.wasm' files. The
+// paths of these files are appended to `wasm_paths', to be linked together.
+static bool
+wasm_split_codegen(std::unique_ptr<llvm::Module> module, unsigned count,
+        llvm::CodeGenOpt::Level opt_level, std::string base_path,
+        std::vector<std::string> &wasm_paths, std::string &error)
+{
+    auto target_machine = wasm_target_machine_get(opt_level, error);
+    if (!target_machine) {
+        return false;
+    }
+    module->setTargetTriple(WASM_TRIPLE);
+    module->setDataLayout(target_machine->createDataLayout());
+    target_machine.reset();
+
+    std::vector<std::unique_ptr<llvm::raw_fd_ostream>> streams;
+    std::vector<llvm::raw_pwrite_stream *> streams_ptrs;
+    for (unsigned i = 0; i < count; i++) {
+        auto path = base_path + "." + std::to_string(i) + ".wasm";
+        std::error_code EC;
+        streams.push_back(llvm::make_unique<llvm::raw_fd_ostream>(path, EC,
+                    llvm::sys::fs::F_None));
+        if (EC) {
+            error = "error when opening file " + path + ": " + EC.message();
+            return false;
+        }
+        streams_ptrs.push_back(streams.back().get());
+        wasm_paths.push_back(path);
+    }
+
+    // Called from the threads of splitCodeGen(), which keeps the target
+    // machines and has no way to report a failure, so it exits. One was
+    // created above, so it shouldn't happen.
+    llvm::splitCodeGen(std::move(module), streams_ptrs, {},
+            [&]() {
+                std::string error;
+                auto target_machine = wasm_target_machine_create(opt_level,
+                    error);
+                if (!target_machine) {
+                    ERROR("%s\n", error.c_str());
+                }
+                return target_machine;
+            });
+
+    for (auto &stream : streams) {
+        stream->flush();
+    }
+    return true;
+}
+
+// Everything the code generated by this driver depends on, besides its input.
+static std::vector<std::string>
+codegen_key_parts(const char *what, llvm::CodeGenOpt::Level opt,
+        unsigned opt_size)
+{
+    std::vector<std::string> key_parts;
+    key_parts.push_back(what);
+    key_parts.push_back(CACHE_VERSION);
+    key_parts.push_back(LLVM_VERSION_STRING);
+    key_parts.push_back(WASM_TRIPLE);
+    key_parts.push_back(std::to_string(opt));
+    key_parts.push_back(std::to_string(opt_size));
+    return key_parts;
+}
+
+// The cache key of the object generated from `bitcode_path' (see
+// wasm_codegen2()). Returns an empty string on failure.
+static std::string
+wasm_codegen_key(std::string &bitcode_path, llvm::CodeGenOpt::Level opt,
+        std::string &error)
+{
+    auto hash = file_hash(bitcode_path, error);
+    if (hash.empty()) {
+        return "";
+    }
+    auto key_parts = codegen_key_parts("wasm", opt, 0);
+    key_parts.push_back(hash);
+    return cache_key(key_parts);
+}
+
+// Parses `bitcode_path' in its own LLVM context and generates its code into
+// `wasm_path'.
+static bool
+bitcode_codegen(std::string &bitcode_path, llvm::CodeGenOpt::Level opt,
+        std::string wasm_path, std::string &error)
+{
+    llvm::LLVMContext context;
+    context.setDiagnosticHandlerCallBack(diagnostic_handler, NULL, true);
+
+    uint64_t start = time_now();
+    llvm::SMDiagnostic err;
+    auto module = llvm::parseIRFile(bitcode_path, err, context);
+    if (!module) {
+        error = "parsing bitcode file `" + bitcode_path + "' failed: "
+            + err.getFilename().str() + ":" + std::to_string(err.getLineNo())
+            + ": " + err.getMessage().str();
+        return false;
+    }
+    trace_add("parse", bitcode_path, start);
+
+    return wasm_codegen(module.get(), opt, context, wasm_path, error);
+}
+
+// Looks up the object generated from `bitcode_path' in the cache under `key',
+// generating it if needed, and sets its path in `wasm_path'.
+static bool
+wasm_codegen_cached(std::string &bitcode_path, llvm::CodeGenOpt::Level opt,
+        const std::string &key, std::string &wasm_path, std::string &error)
+{
+    wasm_path = cache_entry_path(key, ".wasm");
+    bool exists = false;
+    if (!cache_entry_exists(wasm_path, exists, error) || exists) {
+        return exists;
+    }
+
+    auto temp_path = cache_temp_path(key, error);
+    if (temp_path.empty()) {
+        return false;
+    }
+    if (!bitcode_codegen(bitcode_path, opt, temp_path, error)) {
+        unlink(temp_path.c_str());
+        return false;
+    }
+    return cache_commit(temp_path, wasm_path, error);
+}
+
+// Can be called from multiple threads at the same time, each call parsing and
+// generating code for its module in its own LLVM context. The generated object
+// file is looked up in the cache first, and its path is set in `wasm_path'.
+static bool
+wasm_codegen2(std::string &bitcode_path, llvm::CodeGenOpt::Level opt,
+        std::string &wasm_path, std::string &error)
+{
+    auto key = wasm_codegen_key(bitcode_path, opt, error);
+    if (key.empty()) {
+        return false;
+    }
+    return wasm_codegen_cached(bitcode_path, opt, key, wasm_path, error);
+}
+
+// The runtime objects shipped for each optimization level (see
+// runtime_object_main()) are generated like wasm_codegen2() does, and come
+// with their cache key in a `.key' file. They are only used if that key is
+// the one of the runtime.bc being linked.
+static std::string
+runtime_object_path(llvm::CodeGenOpt::Level opt)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof path, "%s/runtime-O%d.wasm", libdir_path,
+            (int)opt);
+    return path;
+}
+
+static bool
+runtime_object_matches(const std::string &path, const std::string &key,
+        bool &matches, std::string &error)
+{
+    auto buffer = llvm::MemoryBuffer::getFile(path + ".key");
+    matches = false;
+    if (!buffer || (*buffer)->getBuffer().trim() != key) {
+        return true;
+    }
+    return file_may_exist(path, matches, error);
+}
+
+// The linker reads its inputs from files, so a runtime object that the
+// compile server keeps in memory is written to the build cache, once.
+static bool
+resident_object_write(const resident_object &object, std::string &wasm_path,
+        std::string &error)
+{
+    wasm_path = cache_entry_path(object.key, ".wasm");
+    bool exists = false;
+    if (!cache_entry_exists(wasm_path, exists, error) || exists) {
+        return exists;
+    }
+
+    auto temp_path = cache_temp_path(object.key, error);
+    if (temp_path.empty()) {
+        return false;
+    }
+    FILE *file = fopen(temp_path.c_str(), "w");
+    auto data = object.buffer->getBuffer();
+    if (file == NULL
+            || fwrite(data.data(), 1, data.size(), file) != data.size()
+            || fclose(file) != 0) {
+        error = "can't write `" + temp_path + "': " + strerror(errno);
+        unlink(temp_path.c_str());
+        return false;
+    }
+    return cache_commit(temp_path, wasm_path, error);
+}
+
+// ThinLTO mode: each module (the runtime and every assembly) gets a summary,
+// the summaries are combined to decide which functions each module imports
+// from the others, then every module is optimized with its imports and
+// code-generated separately, in parallel and through the cache.
+
+// Writes a copy of `bitcode_path' with its module summary in the cache, whose
+// path is set in `summary_path' and key in `summary_key'. Can be called from
+// multiple threads at the same time.
+static bool
+thin_lto_summarize(std::string &bitcode_path, std::string &summary_path,
+        std::string &summary_key, std::string &error)
+{
+    auto hash = file_hash(bitcode_path, error);
+    if (hash.empty()) {
+        return false;
+    }
+    auto key_parts = codegen_key_parts("summary", llvm::CodeGenOpt::None, 0);
+    key_parts.push_back(hash);
+    summary_key = cache_key(key_parts);
+
+    summary_path = cache_entry_path(summary_key, ".thin.bc");
+    bool exists = false;
+    if (!cache_entry_exists(summary_path, exists, error)) {
+        return false;
+    }
+    if (!exists) {
+        llvm::LLVMContext context;
+        context.setDiagnosticHandlerCallBack(diagnostic_handler, NULL, true);
+
+        uint64_t start = time_now();
         llvm::SMDiagnostic err;
         auto module = llvm::parseIRFile(bitcode_path, err, context);
         if (!module) {
-            ERROR("parsing bitcode file `%s' failed: %s:%d: %s\n",
-                    bitcode_path.c_str(), err.getFilename().str().c_str(),
-                    err.getLineNo(), err.getMessage().str().c_str());
+            error = "parsing bitcode file `" + bitcode_path + "' failed: "
+                + err.getFilename().str() + ":"
+                + std::to_string(err.getLineNo()) + ": "
+                + err.getMessage().str();
+            return false;
         }
+        trace_add("parse", bitcode_path, start);
 
-        wasm_codegen(module.get(), opt, context, wasm_path);
+        start = time_now();
+        auto index = llvm::buildModuleSummaryIndex(*module, nullptr, nullptr);
+
+        auto temp_path = cache_temp_path(summary_key, error);
+        if (temp_path.empty()) {
+            return false;
+        }
+        std::error_code EC;
+        llvm::raw_fd_ostream dest(temp_path, EC, llvm::sys::fs::F_None);
+        if (EC) {
+            error = "error when opening file " + temp_path + ": "
+                + EC.message();
+            unlink(temp_path.c_str());
+            return false;
+        }
+        // The module hash is needed to give unique names to the local symbols
+        // that get promoted when imported by other modules.
+        llvm::WriteBitcodeToFile(module.get(), dest, false, &index, true);
+        dest.close();
+        if (!cache_commit(temp_path, summary_path, error)) {
+            return false;
+        }
+        trace_add("summary", bitcode_path, start);
     }
+    return true;
 }
 
-static void
+// What the codegen of a module needs from the import analysis. The records are
+// all created before the codegen tasks start, which then only read them.
+struct thin_lto_module {
+    llvm::FunctionImporter::ImportMapTy imports;
+    // The generated code depends on the imported functions, and on which of
+    // the module's own local symbols are exported (and thus promoted).
+    std::vector<std::string> key_parts;
+};
+
+struct thin_lto_state {
+    llvm::ModuleSummaryIndex index;
+    std::map<std::string, thin_lto_module> modules; // by summary path
+};
+
+static bool
+thin_lto_analyze(std::vector<std::string> &summary_paths,
+        std::vector<std::string> &summary_keys,
+        std::vector<std::string> &assembly_paths, thin_lto_state &state,
+        std::string &error)
+{
+    for (int i = 0; i < summary_paths.size(); i++) {
+        auto buffer = llvm::MemoryBuffer::getFile(summary_paths[i]);
+        if (!buffer) {
+            error = "can't read `" + summary_paths[i] + "': "
+                + buffer.getError().message();
+            return false;
+        }
+        auto E = llvm::readModuleSummaryIndex((*buffer)->getMemBufferRef(),
+                state.index, i);
+        if (E) {
+            error = "reading summary of `" + summary_paths[i] + "' failed: "
+                + llvm::toString(std::move(E));
+            return false;
+        }
+    }
+
+    // Symbols used from outside the summarized modules: the JS exports, and
+    // what the AOT init module (generated separately) refers to.
+    llvm::DenseSet<llvm::GlobalValue::GUID> preserved;
+    for (auto js_export : js_exports) {
+        preserved.insert(llvm::GlobalValue::getGUID(js_export));
+    }
+    preserved.insert(llvm::GlobalValue::getGUID("mono_aot_register_module"));
+    for (auto path : assembly_paths) {
+        preserved.insert(llvm::GlobalValue::getGUID(
+                    aot_module_info_name(path)));
+    }
+    llvm::computeDeadSymbols(state.index, preserved);
+
+    llvm::StringMap<llvm::GVSummaryMapTy> defined_summaries;
+    state.index.collectDefinedGVSummariesPerModule(defined_summaries);
+    llvm::StringMap<llvm::FunctionImporter::ImportMapTy> import_lists;
+    llvm::StringMap<llvm::FunctionImporter::ExportSetTy> export_lists;
+    llvm::ComputeCrossModuleImport(state.index, defined_summaries,
+            import_lists, export_lists);
+
+    std::map<std::string, std::string> path_keys;
+    for (int i = 0; i < summary_paths.size(); i++) {
+        path_keys[summary_paths[i]] = summary_keys[i];
+    }
+
+    // Modules which import or export nothing have no entry in the lists.
+    for (int i = 0; i < summary_paths.size(); i++) {
+        auto &module = state.modules[summary_paths[i]];
+        module.key_parts.push_back(summary_keys[i]);
+
+        auto import_list = import_lists.find(summary_paths[i]);
+        if (import_list != import_lists.end()) {
+            module.imports = std::move(import_list->second);
+        }
+        std::map<std::string, std::vector<llvm::GlobalValue::GUID>> imports;
+        for (auto &entry : module.imports) {
+            auto &guids = imports[path_keys[entry.first().str()]];
+            for (auto &function : entry.second) {
+                guids.push_back(function.first);
+            }
+            std::sort(guids.begin(), guids.end());
+        }
+        for (auto &entry : imports) {
+            module.key_parts.push_back(entry.first);
+            for (auto guid : entry.second) {
+                module.key_parts.push_back(std::to_string(guid));
+            }
+        }
+
+        std::vector<llvm::GlobalValue::GUID> exports;
+        auto export_list = export_lists.find(summary_paths[i]);
+        if (export_list != export_lists.end()) {
+            exports.assign(export_list->second.begin(),
+                    export_list->second.end());
+        }
+        std::sort(exports.begin(), exports.end());
+        module.key_parts.push_back("exports");
+        for (auto guid : exports) {
+            module.key_parts.push_back(std::to_string(guid));
+        }
+    }
+    return true;
+}
+
+// Imports functions into the `summary_path' module, optimizes it and generates
+// its code, whose path in the cache is set in `wasm_path'. Can be called from
+// multiple threads at the same time.
+static bool
+thin_lto_codegen(std::string &summary_path, const thin_lto_state &state,
+        llvm::CodeGenOpt::Level opt, unsigned opt_size, std::string &wasm_path,
+        std::string &error)
+{
+    auto thin_module = state.modules.find(summary_path);
+    if (thin_module == state.modules.end()) {
+        error = "no import analysis for `" + summary_path + "'";
+        return false;
+    }
+    auto &import_list = thin_module->second.imports;
+
+    auto key_parts = codegen_key_parts("thin", opt, opt_size);
+    key_parts.insert(key_parts.end(), thin_module->second.key_parts.begin(),
+            thin_module->second.key_parts.end());
+    auto key = cache_key(key_parts);
+
+    wasm_path = cache_entry_path(key, ".wasm");
+    bool exists = false;
+    if (!cache_entry_exists(wasm_path, exists, error) || exists) {
+        return exists;
+    }
+
+    llvm::LLVMContext context;
+    context.setDiagnosticHandlerCallBack(diagnostic_handler, NULL, true);
+
+    uint64_t start = time_now();
+    llvm::SMDiagnostic err;
+    auto module = llvm::parseIRFile(summary_path, err, context);
+    if (!module) {
+        error = "parsing bitcode file `" + summary_path + "' failed: "
+            + err.getFilename().str() + ":" + std::to_string(err.getLineNo())
+            + ": " + err.getMessage().str();
+        return false;
+    }
+    trace_add("parse", summary_path, start);
+
+    if (llvm::renameModuleForThinLTO(*module, state.index)) {
+        error = "promoting local symbols of `" + summary_path + "' failed";
+        return false;
+    }
+
+    auto loader = [&](llvm::StringRef identifier)
+        -> llvm::Expected<std::unique_ptr<llvm::Module>> {
+        llvm::SMDiagnostic err;
+        auto module = llvm::getLazyIRFileModule(identifier, err, context,
+                true);
+        if (!module) {
+            return llvm::make_error<llvm::StringError>(
+                    err.getMessage().str(), llvm::inconvertibleErrorCode());
+        }
+        return std::move(module);
+    };
+    start = time_now();
+    llvm::FunctionImporter importer(state.index, loader);
+    auto imported = importer.importFunctions(*module, import_list);
+    if (!imported) {
+        error = "importing functions into `" + summary_path + "' failed: "
+            + llvm::toString(imported.takeError());
+        return false;
+    }
+    trace_add("import", summary_path, start);
+
+    module->setTargetTriple(WASM_TRIPLE);
+    auto target_machine = wasm_target_machine_get(opt, error);
+    if (!target_machine) {
+        return false;
+    }
+    module->setDataLayout(target_machine->createDataLayout());
+
+    start = time_now();
+    llvm::legacy::PassManager pm;
+    optimize_passes_add(pm, target_machine.get(), opt, opt_size, true);
+    pm.run(*module);
+    trace_add("optimize", summary_path, start);
+
+    auto temp_path = cache_temp_path(key, error);
+    if (temp_path.empty()) {
+        return false;
+    }
+    if (!wasm_codegen(module.get(), opt, context, temp_path, error)) {
+        unlink(temp_path.c_str());
+        return false;
+    }
+    return cache_commit(temp_path, wasm_path, error);
+}
+
+static bool
 wasm_link(std::vector<std::string> &paths, std::string output,
-        bool strip_debug_info)
+        bool strip_debug_info, std::string &error)
 {
     std::vector<const char *> args;
     args.push_back("wasm-lld");
@@ -397,31 +1898,38 @@ wasm_link(std::vector<std::string> &paths, std::string output,
         args.push_back("--strip-debug");
     }
 
-    if (!lld::wasm::link(args, false)) {
-        ERROR("failed to link wasm files\n");
-    }
+    uint64_t start = time_now();
+    bool ok = lld::wasm::link(args, false);
+    trace_add("lld", output, start);
 
     for (int i = 0; i < paths.size(); i++) {
         free((char *)args[i + 1]);
     }
+
+    if (!ok) {
+        error = "failed to link wasm files";
+    }
+    return ok;
 }
 
-static void
-assembly_strip(std::vector<std::string> &paths, const char *output_path)
+// Called from multiple threads at the same time, so it reports failures to
+// the caller (in `error') instead of exiting.
+static bool
+assembly_strip(std::string path, const char *output_path, std::string &error)
 {
-    for (auto path : paths) {
-        const char *base = strrchr(path.c_str(), '/');
-        assert(base != NULL);
-
-        char cmd[PATH_MAX];
-        snprintf(cmd, sizeof cmd, "mono-cil-strip %s %s%s >& /dev/null",
-                path.c_str(), output_path, base);
-
-        if (system(cmd) != 0) {
-            ERROR("IL strip for `%s' failed (command was: %s)\n",
-                    path.c_str(), cmd);
-        }
+    const char *base = strrchr(path.c_str(), '/');
+    assert(base != NULL);
+
+    uint64_t start = time_now();
+    bool ok = command_run({ "mono-cil-strip", path,
+            std::string(output_path) + base }, {}, true, error);
+    trace_add("mono-cil-strip", path, start);
+    if (!ok) {
+        error = "IL strip for `" + path + "' failed: " + error;
+        return false;
     }
+
+    return true;
 }
 
 extern "C" {
@@ -430,17 +1938,45 @@ extern "C" {
     void jsmin(void);
 }
 
-static void
-js_gen(std::vector<std::string> &assembly_paths, const char *output_path)
+// The main assembly and mscorlib are always needed to start, so index.js
+// loads them before running Main(). The others are downloaded in the
+// background while the code compiles, and loaded when the runtime first opens
+// them (synchronously, if their download isn't done by then).
+static bool
+assembly_is_eager(std::vector<std::string> &assembly_paths, size_t i)
+{
+    const char *base = strrchr(assembly_paths[i].c_str(), '/');
+    assert(base != NULL);
+    return i == 0 || strcmp(base + 1, "mscorlib.dll") == 0;
+}
+
+static bool
+js_gen(std::vector<std::string> &assembly_paths, const char *output_path,
+        bool snapshot, std::string &error)
 {
     auto index_js = std::string(libdir_path) + "/index.js";
-    FILE_MUST_EXIST(index_js.c_str());
+
+    // The hash of the generated code and of the (stripped) assemblies, used
+    // to invalidate what index.js caches in the browser.
+    std::vector<std::string> hashes;
+    hashes.push_back(file_hash(std::string(output_path) + "/index.wasm",
+                error));
+    if (hashes.back().empty()) {
+        return false;
+    }
+    for (size_t i = 0; i < assembly_paths.size(); i++) {
+        const char *base = strrchr(assembly_paths[i].c_str(), '/');
+        hashes.push_back(file_hash(std::string(output_path) + base, error));
+        if (hashes.back().empty()) {
+            return false;
+        }
+    }
 
     auto output_index_js = std::string(output_path) + "/index.js";
     FILE *output = fopen(output_index_js.c_str(), "w+");
     if (output == NULL) {
-        ERROR("can't open `%s': %s\n", output_index_js.c_str(),
-                strerror(errno));
+        error = "can't open `" + output_index_js + "': " + strerror(errno);
+        return false;
     }
 
     fprintf(output, "var files=[");
@@ -451,7 +1987,32 @@ js_gen(std::vector<std::string> &assembly_paths, const char *output_path)
     }
     fprintf(output, "];");
 
+    fprintf(output, "var files_manifest={");
+    for (size_t i = 0; i < assembly_paths.size(); i++) {
+        const char *base = strrchr(assembly_paths[i].c_str(), '/');
+        auto path = std::string(output_path) + base;
+        struct stat s;
+        if (stat(path.c_str(), &s) != 0) {
+            error = "can't stat `" + path + "': " + strerror(errno);
+            fclose(output);
+            return false;
+        }
+        fprintf(output, "\"%s\":{size:%lld,hash:\"%s\",eager:%s},",
+                base + 1, (long long)s.st_size, hashes[i + 1].c_str(),
+                assembly_is_eager(assembly_paths, i) ? "true" : "false");
+    }
+    fprintf(output, "};");
+    fprintf(output, "var files_hash=\"%s\";", cache_key(hashes).c_str());
+    if (snapshot) {
+        fprintf(output, "var snapshot_file=\"index.snapshot\";");
+    }
+
     jsmin_in = fopen(index_js.c_str(), "r");
+    if (jsmin_in == NULL) {
+        error = "can't open `" + index_js + "': " + strerror(errno);
+        fclose(output);
+        return false;
+    }
     jsmin_out = output;
 
     jsmin();
@@ -461,21 +2022,94 @@ js_gen(std::vector<std::string> &assembly_paths, const char *output_path)
 
     jsmin_in = NULL;
     jsmin_out = NULL;
+    return true;
 }
 
-static std::string
-swap_extension(std::string path, const char *new_extension)
+// Writes the <link rel="preload"> tags that let the browser download the
+// code and the assemblies needed to start as soon as it parses the page
+// <head>, before index.js runs, and <link rel="prefetch"> tags for the other
+// assemblies. Meant to be included in the page (see README.md).
+static bool
+preload_html_gen(std::vector<std::string> &assembly_paths,
+        const char *output_path, bool snapshot, std::string &error)
 {
-    auto pos = path.rfind('.');
-    if (pos != std::string::npos) {
-        assert(pos > 0);
-        path = path.substr(0, pos);
+    auto output_html = std::string(output_path) + "/index.preload.html";
+    FILE *output = fopen(output_html.c_str(), "w");
+    if (output == NULL) {
+        error = "can't open `" + output_html + "': " + strerror(errno);
+        return false;
     }
-    return path + new_extension;
+
+    // `crossorigin' makes the preloads match the (CORS mode) fetch() calls.
+    fprintf(output, "<link rel=\"preload\" href=\"index.wasm\" as=\"fetch\" "
+            "type=\"application/wasm\" crossorigin>\n");
+    fprintf(output, "<link rel=\"preload\" href=\"index.js\" "
+            "as=\"script\">\n");
+    if (snapshot) {
+        fprintf(output, "<link rel=\"preload\" href=\"index.snapshot\" "
+                "as=\"fetch\" crossorigin>\n");
+    }
+    for (size_t i = 0; i < assembly_paths.size(); i++) {
+        const char *base = strrchr(assembly_paths[i].c_str(), '/');
+        assert(base != NULL);
+        if (assembly_is_eager(assembly_paths, i)) {
+            fprintf(output, "<link rel=\"preload\" href=\"%s\" "
+                    "as=\"fetch\" crossorigin>\n", base + 1);
+        }
+        else {
+            fprintf(output, "<link rel=\"prefetch\" href=\"%s\">\n",
+                    base + 1);
+        }
+    }
+
+    fclose(output);
+    return true;
 }
 
-int
-main(int argc, char **argv)
+// Runs index.js in a JS shell (node, unless the MONO_WASM_JS_SHELL
+// environment variable names another one), which boots the runtime and saves
+// the memory in index.snapshot, for index.js to restore instead of booting.
+static bool
+js_snapshot(const char *output_path, std::string &error)
+{
+    const char *shell = getenv("MONO_WASM_JS_SHELL");
+    if (shell == NULL || *shell == '\0') {
+        shell = "node";
+    }
+
+    // index.js loads its files relative to the current directory, so the
+    // shell runs from the output directory. It's entered in the child rather
+    // than through `cd' in a shell command, which would need the path quoted.
+    const char *argv[] = { shell, "index.js", "--", "--snapshot", NULL };
+    uint64_t start = time_now();
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (chdir(output_path) != 0) {
+            _exit(127);
+        }
+        execvp(shell, (char **)argv);
+        _exit(127);
+    }
+    if (pid < 0) {
+        error = std::string("can't fork: ") + strerror(errno);
+        return false;
+    }
+
+    int status = -1;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    trace_add("js-shell", "snapshot", start);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        error = std::string("snapshot failed (command was: ") + shell
+            + " index.js -- --snapshot, in `" + output_path + "')";
+        return false;
+    }
+
+    return true;
+}
+
+static int
+driver_main(int argc, char **argv)
 {
     if (argc < 2) {
         ERROR("Usage: %s [options] <input files>\n\n" \
@@ -483,20 +2117,61 @@ main(int argc, char **argv)
                 "    -b <directory>        Specify build directory\n" \
                 "                          (default is `./build')\n" \
                 "    -o <directory>        Specify output directory\n" \
+                "    --cache-dir <dir>     Specify build cache directory\n" \
+                "                          (default is `<build>/cache')\n" \
+                "    --cache-size <MB>     Remove the least recently used\n" \
+                "                          cache entries past this size\n" \
+                "                          (default is 2048, 0 for no limit)\n" \
                 "    -On                   Specify optimization level\n" \
-                "                          (0, 1, 2, 3, default is 2)\n" \
+                "                          (0, 1, 2, 3, s, z, default is 2)\n" \
+                "    -j <n>                Number of parallel jobs\n" \
+                "                          (default is the number of cores)\n" \
                 "    --strip-debug         Strip debugging information\n" \
-                "    -v                    Verbose output\n" \
-                "    -i                    Incremental build (experimental)\n",
-                argv[0]);
+                "    -v                    Verbose output, with the time taken\n" \
+                "                          by each build step\n" \
+                "    -i                    Incremental build (experimental)\n" \
+                "    --thin-lto            Optimize across modules with ThinLTO\n" \
+                "                          then generate code for each of them\n" \
+                "                          in parallel (ignores `-i')\n" \
+                "    --split-codegen       Split the linked module and generate\n" \
+                "                          code for each piece in parallel,\n" \
+                "                          on the idle jobs (ignored with `-i')\n" \
+                "    --trace=<file>        Write a trace of the build steps\n" \
+                "                          (time and memory) to <file>,\n" \
+                "                          in the Chrome trace event format\n" \
+                "    --snapshot            Boot the runtime at build time, in\n" \
+                "                          the MONO_WASM_JS_SHELL JS shell\n" \
+                "                          (default is `node'), and save its\n" \
+                "                          memory for index.js to restore\n" \
+                "\n" \
+                "       %s --server <socket>\n\n" \
+                "    Runs a compile server, keeping the runtime in memory,\n" \
+                "    to which builds are forwarded when the MONO_WASM_SERVER\n" \
+                "    environment variable is set to the server socket path.\n" \
+                "    Restart it after installing a new runtime.bc: builds\n" \
+                "    still work, but read the runtime again every time.\n" \
+                "\n" \
+                "       %s --runtime-object -On <runtime.bc> <output>\n\n" \
+                "    Generates the runtime object that incremental builds\n" \
+                "    use at optimization level n (0 to 3), and its cache key\n" \
+                "    in <output>.key.\n",
+                argv[0], argv[0], argv[0]);
     }
 
     const char *build_path = "./build";
     const char *output_path = NULL;
+    const char *cache_dir = NULL;
+    const char *trace_path = NULL;
+    uint64_t cache_max_size = CACHE_MAX_SIZE;
     llvm::CodeGenOpt::Level opt = llvm::CodeGenOpt::Default;
+    unsigned opt_size = 0;
     bool strip_debug_info = false;
     bool verbose = false;
     bool incremental = false;
+    bool split_codegen = false;
+    bool thin_lto = false;
+    bool snapshot = false;
+    unsigned jobs = std::thread::hardware_concurrency();
     std::vector<std::string> assembly_paths, bitcode_paths, wasm_paths;
     for (int i = 1; i < argc; i++) {
         const char *arg = argv[i];
@@ -515,6 +2190,37 @@ main(int argc, char **argv)
                 }
                 output_path = argv[i];
             }
+            else if (strcmp(arg, "--cache-dir") == 0) {
+                i++;
+                if (i >= argc) {
+                    ERROR("expected value for `--cache-dir' option\n");
+                }
+                cache_dir = argv[i];
+            }
+            else if (strcmp(arg, "--cache-size") == 0) {
+                i++;
+                if (i >= argc) {
+                    ERROR("expected value for `--cache-size' option\n");
+                }
+                char *end = NULL;
+                long long n = strtoll(argv[i], &end, 10);
+                if (*end != '\0' || n < 0) {
+                    ERROR("malformed `--cache-size' option\n");
+                }
+                cache_max_size = (uint64_t)n * 1024 * 1024;
+            }
+            else if (arg[1] == 'j' && arg[2] == '\0') {
+                i++;
+                if (i >= argc) {
+                    ERROR("expected value for `-j' option\n");
+                }
+                char *end = NULL;
+                long n = strtol(argv[i], &end, 10);
+                if (*end != '\0' || n <= 0) {
+                    ERROR("malformed `-j' option\n");
+                }
+                jobs = n;
+            }
             else if (arg[1] == 'v' && arg[2] == '\0') {
                 verbose = true;
             }
@@ -535,6 +2241,14 @@ main(int argc, char **argv)
                     case '3':
                         opt = llvm::CodeGenOpt::Aggressive;
                         break;
+                    case 's':
+                        opt = llvm::CodeGenOpt::Default;
+                        opt_size = 1;
+                        break;
+                    case 'z':
+                        opt = llvm::CodeGenOpt::Default;
+                        opt_size = 2;
+                        break;
                     default:
                         ERROR("malformed `-On' option\n");
                 }
@@ -542,6 +2256,18 @@ main(int argc, char **argv)
             else if (strcmp(arg, "--strip-debug") == 0) {
                 strip_debug_info = true;
             }
+            else if (strcmp(arg, "--thin-lto") == 0) {
+                thin_lto = true;
+            }
+            else if (strcmp(arg, "--split-codegen") == 0) {
+                split_codegen = true;
+            }
+            else if (strncmp(arg, "--trace=", 8) == 0) {
+                trace_path = arg + 8;
+            }
+            else if (strcmp(arg, "--snapshot") == 0) {
+                snapshot = true;
+            }
             else {
                 ERROR("invalid `%s' option\n", arg);
             }
@@ -557,7 +2283,19 @@ main(int argc, char **argv)
         ERROR("at least one input file is required\n");
     }
 
+    if (jobs == 0) {
+        jobs = 1;
+    }
+
     setup_paths(argv[0]);
+    wasm_target_init();
+
+    if (cache_dir != NULL) {
+        cache_setup(cache_dir);
+    }
+    else {
+        cache_setup((std::string(build_path) + "/cache").c_str());
+    }
 
     if (!DIR_MAY_EXIST(output_path)) {
         if (mkdir(output_path, 0755) != 0) {
@@ -568,72 +2306,644 @@ main(int argc, char **argv)
 
     auto output_wasm = std::string(output_path) + "/index.wasm";
 
-    llvm::LLVMContext context;
+    llvm::LLVMContext local_context;
+    auto &context = resident.context != NULL
+        ? *resident.context : local_context;
     context.setDiagnosticHandlerCallBack(diagnostic_handler, NULL, true);
 
-    uint64_t start = 0, total = 0, delta = 0;
-    mach_timebase_info_data_t timebase_info;
-    mach_timebase_info(&timebase_info);
+    task_graph graph;
+    graph.verbose = verbose;
+
+    auto runtime_bitcode_path = std::string(libdir_path) + "/runtime.bc";
+    std::string runtime_wasm_path, runtime_summary_path, runtime_summary_key;
+    std::vector<std::string> compile_keys, summary_paths, summary_keys;
+    std::vector<std::string> index_wasm_paths;
+    std::unique_ptr<llvm::Module> module;
+    thin_lto_state thin_state;
+    auto aot_init_path = std::string(build_path) + "/aot_init.wasm";
+    uint64_t build_start = time_now();
+    if (trace_path != NULL) {
+        trace_init(trace_path);
+    }
 
-#define T_MEASURE(what, code) \
-    start = mach_absolute_time(); \
-    if (verbose) { \
-        std::string _what = what; \
-        printf("%s ... ", _what.c_str()); \
-    } \
-    code; \
-    delta = mach_absolute_time() - start; \
-    total += delta; \
-    if (verbose) { \
-        printf("%.3fs\n", (((double)(delta) * timebase_info.numer) \
-                    / (timebase_info.denom * 1000000000))); \
+    // The runtime doesn't depend on the assemblies, so its summary or its
+    // code can be generated while they are being linked and compiled.
+    size_t runtime_task = TASK_NONE;
+    if (thin_lto) {
+        runtime_task = task_add(graph,
+                "ThinLTO summary " + runtime_bitcode_path, {},
+                [&](std::string &error) {
+                    return thin_lto_summarize(runtime_bitcode_path,
+                        runtime_summary_path, runtime_summary_key, error);
+                });
+    }
+    else if (incremental) {
+        // The runtime object is shipped already generated for each
+        // optimization level, unless runtime.bc was changed since.
+        runtime_task = task_add(graph,
+                "IR/WASM codegen " + runtime_bitcode_path, {},
+                [&](std::string &error) {
+                    auto key = wasm_codegen_key(runtime_bitcode_path, opt,
+                        error);
+                    if (key.empty()) {
+                        return false;
+                    }
+                    auto object = resident.runtime_objects.find(opt);
+                    if (object != resident.runtime_objects.end()
+                            && object->second.key == key) {
+                        return resident_object_write(object->second,
+                            runtime_wasm_path, error);
+                    }
+                    auto prebuilt_path = runtime_object_path(opt);
+                    bool matches = false;
+                    if (!runtime_object_matches(prebuilt_path, key, matches,
+                                error)) {
+                        return false;
+                    }
+                    if (matches) {
+                        runtime_wasm_path = prebuilt_path;
+                        return true;
+                    }
+                    return wasm_codegen_cached(runtime_bitcode_path, opt,
+                        key, runtime_wasm_path, error);
+                });
     }
 
-    T_MEASURE("IL link", assembly_link(assembly_paths, build_path));
+    // Everything else depends on the list of linked assemblies, so the tasks
+    // are created once the IL link is done.
+    size_t il_link_task = TASK_NONE;
+    il_link_task = task_add(graph, "IL link", {}, [&](std::string &error) {
+        if (!assembly_link(assembly_paths, build_path, error)
+                || !assembly_compile_keys(assembly_paths, compile_keys,
+                    error)) {
+            return false;
+        }
 
-    bitcode_paths.push_back(std::string(libdir_path) + "/runtime.bc");
-    for (auto assembly_path : assembly_paths) {
-        auto bitcode_path = swap_extension(assembly_path, ".bc");
-        T_MEASURE(std::string("IL/IR compile ") + assembly_path,
-                assembly_compile(assembly_path, build_path, bitcode_path));
-        bitcode_paths.push_back(bitcode_path);
+        size_t count = assembly_paths.size();
+        bitcode_paths.resize(count);
+        wasm_paths.resize(count);
+        summary_paths.resize(count);
+        summary_keys.resize(count);
+
+        std::vector<size_t> compile_tasks, output_tasks;
+        for (size_t i = 0; i < count; i++) {
+            compile_tasks.push_back(task_add(graph,
+                        "IL/IR compile " + assembly_paths[i], { il_link_task },
+                        [&, i](std::string &error) {
+                            return assembly_compile(assembly_paths[i],
+                                build_path, compile_keys[i], bitcode_paths[i],
+                                error);
+                        }));
+
+            output_tasks.push_back(task_add(graph,
+                        "IL strip " + assembly_paths[i], { il_link_task },
+                        [&, i](std::string &error) {
+                            return assembly_strip(assembly_paths[i],
+                                output_path, error);
+                        }));
+        }
+
+        std::vector<size_t> link_deps;
+        if (thin_lto || incremental) {
+            link_deps.push_back(task_add(graph, "AOT init codegen",
+                        { il_link_task }, [&](std::string &error) {
+                            auto aot_init_mod = aot_init_gen(assembly_paths,
+                                NULL, context);
+                            bool ok = wasm_codegen(aot_init_mod, opt, context,
+                                aot_init_path, error);
+                            delete aot_init_mod;
+                            return ok;
+                        }));
+        }
+
+        if (thin_lto) {
+            std::vector<size_t> analyze_deps = { runtime_task };
+            for (size_t i = 0; i < count; i++) {
+                analyze_deps.push_back(task_add(graph,
+                            "ThinLTO summary " + assembly_paths[i],
+                            { compile_tasks[i] }, [&, i](std::string &error) {
+                                return thin_lto_summarize(bitcode_paths[i],
+                                    summary_paths[i], summary_keys[i], error);
+                            }));
+            }
+
+            size_t analyze_task = task_add(graph, "ThinLTO import analysis",
+                    analyze_deps, [&](std::string &error) {
+                        std::vector<std::string> paths, keys;
+                        paths.push_back(runtime_summary_path);
+                        keys.push_back(runtime_summary_key);
+                        paths.insert(paths.end(), summary_paths.begin(),
+                            summary_paths.end());
+                        keys.insert(keys.end(), summary_keys.begin(),
+                            summary_keys.end());
+                        return thin_lto_analyze(paths, keys, assembly_paths,
+                            thin_state, error);
+                    });
+
+            link_deps.push_back(task_add(graph,
+                        "ThinLTO IR/WASM codegen " + runtime_bitcode_path,
+                        { analyze_task }, [&](std::string &error) {
+                            return thin_lto_codegen(runtime_summary_path,
+                                thin_state, opt, opt_size, runtime_wasm_path,
+                                error);
+                        }));
+            for (size_t i = 0; i < count; i++) {
+                link_deps.push_back(task_add(graph,
+                            "ThinLTO IR/WASM codegen " + assembly_paths[i],
+                            { analyze_task }, [&, i](std::string &error) {
+                                return thin_lto_codegen(summary_paths[i],
+                                    thin_state, opt, opt_size, wasm_paths[i],
+                                    error);
+                            }));
+            }
+        }
+        else if (incremental) {
+            link_deps.push_back(runtime_task);
+            for (size_t i = 0; i < count; i++) {
+                link_deps.push_back(task_add(graph,
+                            "IR/WASM codegen " + assembly_paths[i],
+                            { compile_tasks[i] }, [&, i](std::string &error) {
+                                return wasm_codegen2(bitcode_paths[i], opt,
+                                    wasm_paths[i], error);
+                            }));
+            }
+        }
+        else {
+            // The whole program goes through a chain of steps, each of them
+            // working on the same module (and LLVM context).
+            size_t last_task = task_add(graph, "IR link", compile_tasks,
+                    [&](std::string &error) {
+                        module = bitcode_link(runtime_bitcode_path,
+                            bitcode_paths, assembly_paths, context, error);
+                        return module != NULL;
+                    });
+
+            last_task = task_add(graph, "IR strip", { last_task },
+                    [&](std::string &error) {
+                        return module_strip_unreachable(module.get(),
+                            assembly_paths, verbose, error);
+                    });
+
+            if (opt != llvm::CodeGenOpt::None) {
+                last_task = task_add(graph, "IR optimize", { last_task },
+                        [&](std::string &error) {
+                            return module_optimize(module.get(), opt,
+                                opt_size, error);
+                        });
+            }
+
+            link_deps.push_back(task_add(graph, "IR/WASM codegen",
+                        { last_task }, [&](std::string &error) {
+                            // Split over this thread and the idle ones, so
+                            // that the build keeps to `jobs' threads.
+                            auto path = std::string(build_path) + "/index";
+                            unsigned count = tasks_idle_count(graph, jobs) + 1;
+                            if (split_codegen && count > 1) {
+                                return wasm_split_codegen(std::move(module),
+                                    count, opt, path, index_wasm_paths, error);
+                            }
+                            path += ".wasm";
+                            index_wasm_paths.push_back(path);
+                            return wasm_codegen(module.get(), opt, context,
+                                path, error);
+                        }));
+        }
+
+        output_tasks.push_back(task_add(graph, "WASM link", link_deps,
+                    [&](std::string &error) {
+                        std::vector<std::string> paths;
+                        if (thin_lto || incremental) {
+                            paths.push_back(runtime_wasm_path);
+                            paths.insert(paths.end(), wasm_paths.begin(),
+                                wasm_paths.end());
+                            paths.push_back(aot_init_path);
+                        }
+                        else {
+                            paths = index_wasm_paths;
+                        }
+                        return wasm_link(paths, output_wasm, strip_debug_info,
+                            error);
+                    }));
+
+        // index.js identifies the files it loads by their hash.
+        size_t js_task = task_add(graph, "JS gen", output_tasks,
+                [&](std::string &error) {
+                    return js_gen(assembly_paths, output_path, snapshot, error)
+                        && preload_html_gen(assembly_paths, output_path,
+                            snapshot, error);
+                });
+
+        if (snapshot) {
+            task_add(graph, "JS snapshot", {js_task},
+                    [&](std::string &error) {
+                        return js_snapshot(output_path, error);
+                    });
+        }
+
+        return true;
+    });
+
+    bool ok = tasks_run(graph, jobs);
+    trace_add("build", "build", build_start);
+    trace_write();
+    if (!ok) {
+        ERROR("%s\n", graph.error.c_str());
+    }
+
+    if (cache_max_size > 0) {
+        cache_prune(cache_max_size, verbose);
+    }
+
+    if (verbose) {
+        tasks_critical_path_print(graph);
+        printf("total ... %.3fs\n",
+                time_seconds(time_now() - build_start));
+        printf("peak memory ... %.1f MB (child processes %.1f MB)\n",
+                peak_rss_get(RUSAGE_SELF) / 1024.0,
+                peak_rss_get(RUSAGE_CHILDREN) / 1024.0);
     }
 
-    if (incremental) {
-        for (auto bitcode_path : bitcode_paths) {
-            auto wasm_path = swap_extension(bitcode_path, ".wasm");
-            T_MEASURE(std::string("IR/WASM codegen ")
-                    + bitcode_path.c_str(),
-                    wasm_codegen2(bitcode_path, opt, context, wasm_path));
-            wasm_paths.push_back(wasm_path);
+    return 0;
+}
+
+// The compile server loads the runtime bitcode once, then waits for build
+// requests on a local socket. Each request (the client's working directory
+// and command line) is run in a forked process which inherits the parsed
+// runtime, writes the build output to the client and exits with the build
+// status, which the server then sends as the last byte of the response.
+
+static bool
+fd_read_all(int fd, std::string &data)
+{
+    char buf[4096];
+    while (true) {
+        ssize_t n = read(fd, buf, sizeof buf);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
         }
+        if (n == 0) {
+            return true;
+        }
+        data.append(buf, n);
+    }
+}
 
-        auto path = std::string(build_path) + "/aot_init.wasm";
-        auto aot_init_mod = aot_init_gen(assembly_paths, NULL, context);
-        wasm_codegen(aot_init_mod, opt, context, path);
-        wasm_paths.push_back(path);
-        delete aot_init_mod;
+static bool
+fd_write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        len -= n;
     }
-    else {
-        T_MEASURE("IR link",
-                auto module = bitcode_link(bitcode_paths, context));
+    return true;
+}
 
-        aot_init_gen(assembly_paths, module.get(), context);
+static int
+server_socket_open(const char *path, struct sockaddr_un &addr)
+{
+    if (strlen(path) >= sizeof addr.sun_path) {
+        ERROR("socket path `%s' is too long\n", path);
+    }
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof addr.sun_path - 1);
 
-        auto path = std::string(build_path) + "/index.wasm";
-        T_MEASURE("IR/WASM codegen",
-                wasm_codegen(module.get(), opt, context, path));
-        wasm_paths.push_back(path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        ERROR("can't create socket: %s\n", strerror(errno));
+    }
+    return fd;
+}
+
+// The runtime kept in memory is only used while runtime.bc is the file the
+// server loaded at startup. If it was replaced since (by `make dist-install',
+// for instance), the build reads it again like a regular one does, until the
+// server is restarted.
+static void
+server_runtime_check(void)
+{
+    struct stat s;
+    if (stat(resident.runtime_path.c_str(), &s) == 0
+            && s.st_size == resident.runtime_stat.st_size
+            && timespec_cmp(ST_MTIME(s),
+                ST_MTIME(resident.runtime_stat)) == 0) {
+        return;
+    }
+    fprintf(stderr, "warning: `%s' changed since the compile server started, "
+            "restart the server to keep it in memory again\n",
+            resident.runtime_path.c_str());
+    resident.runtime_hash.clear();
+    resident.runtime_module.reset();
+    resident.runtime_objects.clear();
+}
+
+static void
+server_build(int client_fd)
+{
+    // Request: the working directory, the environment variables then an
+    // empty string, and the arguments, each of them followed by a NUL byte.
+    std::string request;
+    if (!fd_read_all(client_fd, request) || request.empty()
+            || request.back() != '\0') {
+        exit(1);
+    }
+    std::vector<char *> env, args;
+    for (size_t pos = 0; pos < request.size();
+            pos = request.find('\0', pos) + 1) {
+        args.push_back(&request[pos]);
+    }
+    auto env_end = std::find_if(args.begin() + 1, args.end(),
+            [](char *arg) { return *arg == '\0'; });
+    if (env_end == args.end()) {
+        exit(1);
+    }
+    env.assign(args.begin() + 1, env_end);
+    args.erase(args.begin() + 1, env_end + 1);
+    if (args.size() < 2) {
+        exit(1);
+    }
+
+    // The build runs the client's tools (monolinker, mono-cil-strip, the JS
+    // shell) from its PATH and with its MONO_PATH.
+    env.push_back(NULL);
+    environ = env.data();
+
+    if (chdir(args[0]) != 0) {
+        fprintf(stderr, "can't change directory to `%s': %s\n", args[0],
+                strerror(errno));
+        exit(1);
+    }
+
+    dup2(client_fd, STDOUT_FILENO);
+    dup2(client_fd, STDERR_FILENO);
+    close(client_fd);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    server_runtime_check();
+    args.push_back(NULL);
+    exit(driver_main(args.size() - 2, &args[1]));
+}
+
+// Loads the runtime object for `opt' in memory, from the lib directory if it
+// is there, or else by generating it, and leaves a target machine for `opt'
+// in the pool.
+static bool
+server_runtime_object_load(llvm::CodeGenOpt::Level opt, std::string &error)
+{
+    auto key = wasm_codegen_key(resident.runtime_path, opt, error);
+    if (key.empty()) {
+        return false;
+    }
+
+    auto path = runtime_object_path(opt);
+    llvm::SmallString<PATH_MAX> temp_path;
+    bool matches = false;
+    if (!runtime_object_matches(path, key, matches, error)) {
+        return false;
+    }
+    if (!matches) {
+        auto EC = llvm::sys::fs::createTemporaryFile("runtime", "wasm",
+                temp_path);
+        if (EC) {
+            error = "can't create temporary file: " + EC.message();
+            return false;
+        }
+        path = temp_path.str().str();
+        if (!bitcode_codegen(resident.runtime_path, opt, path, error)) {
+            unlink(path.c_str());
+            return false;
+        }
+    }
+
+    auto buffer = llvm::MemoryBuffer::getFile(path);
+    if (!temp_path.empty()) {
+        unlink(path.c_str());
+    }
+    if (!buffer) {
+        error = "can't read `" + path + "': " + buffer.getError().message();
+        return false;
+    }
+
+    auto target_machine = wasm_target_machine_get(opt, error);
+    if (!target_machine) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> guard(resident.lock);
+    resident.runtime_objects[opt] = { key, std::move(*buffer) };
+    return true;
+}
+
+static int
+server_main(int argc, char **argv)
+{
+    if (argc != 3) {
+        ERROR("Usage: %s --server <socket>\n", argv[0]);
+    }
+    const char *socket_path = argv[2];
+
+    setup_paths(argv[0]);
+    wasm_target_init();
+
+    resident.context = new llvm::LLVMContext();
+    resident.context->setDiagnosticHandlerCallBack(diagnostic_handler, NULL,
+            true);
+    resident.runtime_path = std::string(libdir_path) + "/runtime.bc";
+    if (stat(resident.runtime_path.c_str(), &resident.runtime_stat) != 0) {
+        ERROR("can't stat `%s': %s\n", resident.runtime_path.c_str(),
+                strerror(errno));
     }
+    std::string error;
+    resident.runtime_hash = file_hash(resident.runtime_path, error);
+    if (resident.runtime_hash.empty()) {
+        ERROR("%s\n", error.c_str());
+    }
+
+    llvm::SMDiagnostic err;
+    resident.runtime_module = llvm::parseIRFile(resident.runtime_path, err,
+            *resident.context);
+    if (!resident.runtime_module) {
+        ERROR("bitcode parsing error: %s:%d: %s\n",
+                err.getFilename().str().c_str(), err.getLineNo(),
+                err.getMessage().str().c_str());
+    }
+
+    // The runtime objects of incremental builds, and a target machine for
+    // each optimization level.
+    task_graph graph;
+    for (int level = 0; level <= 3; level++) {
+        task_add(graph, "runtime object -O" + std::to_string(level), {},
+                [&, level](std::string &error) {
+                    return server_runtime_object_load(
+                        (llvm::CodeGenOpt::Level)level, error);
+                });
+    }
+    if (!tasks_run(graph, std::thread::hardware_concurrency())) {
+        ERROR("%s\n", graph.error.c_str());
+    }
+
+    // Only the user running the server may submit builds to it.
+    struct sockaddr_un addr;
+    int server_fd = server_socket_open(socket_path, addr);
+    unlink(socket_path);
+    mode_t mask = umask(077);
+    int bound = bind(server_fd, (struct sockaddr *)&addr, sizeof addr);
+    umask(mask);
+    if (bound != 0 || listen(server_fd, 16) != 0) {
+        ERROR("can't listen on `%s': %s\n", socket_path, strerror(errno));
+    }
+    printf("mono-wasm server listening on %s\n", socket_path);
+    fflush(stdout);
+
+    while (true) {
+        int client_fd = accept(server_fd, NULL, NULL);
+        if (client_fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ERROR("accept() failed: %s\n", strerror(errno));
+        }
+
+        // Builds run one at a time, as concurrent ones would likely share
+        // their build directories.
+        pid_t pid = fork();
+        if (pid < 0) {
+            ERROR("fork() failed: %s\n", strerror(errno));
+        }
+        if (pid == 0) {
+            close(server_fd);
+            server_build(client_fd);
+        }
+
+        int status = 0;
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+        }
+        char code = WIFEXITED(status) ? WEXITSTATUS(status)
+            : 128 + WTERMSIG(status);
+        fd_write_all(client_fd, &code, 1);
+        close(client_fd);
+    }
+}
+
+// Forwards the build to the server listening on `socket_path' and prints its
+// output. Returns false if the server can't be reached, in which case the
+// build should run locally.
+static bool
+server_client_run(const char *socket_path, int argc, char **argv,
+        int &status)
+{
+    struct sockaddr_un addr;
+    int fd = server_socket_open(socket_path, addr);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof addr) != 0) {
+        close(fd);
+        return false;
+    }
+
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof cwd) == NULL) {
+        ERROR("can't get current directory: %s\n", strerror(errno));
+    }
+    std::string request = std::string(cwd) + '\0';
+    for (char **env = environ; *env != NULL; env++) {
+        if (**env != '\0') {
+            request += std::string(*env) + '\0';
+        }
+    }
+    request += '\0';
+    for (int i = 0; i < argc; i++) {
+        request += std::string(argv[i]) + '\0';
+    }
+    if (!fd_write_all(fd, request.c_str(), request.size())) {
+        ERROR("can't send build request: %s\n", strerror(errno));
+    }
+    shutdown(fd, SHUT_WR);
+
+    // The last byte received is the status, so output is always printed one
+    // read behind.
+    std::string pending;
+    char buf[4096];
+    while (true) {
+        ssize_t n = read(fd, buf, sizeof buf);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        pending.append(buf, n);
+        fwrite(pending.c_str(), 1, pending.size() - 1, stdout);
+        fflush(stdout);
+        pending.erase(0, pending.size() - 1);
+    }
+    close(fd);
 
-    T_MEASURE("WASM link",
-            wasm_link(wasm_paths, output_wasm, strip_debug_info));
+    if (pending.size() != 1) {
+        ERROR("compile server connection lost\n");
+    }
+    status = (unsigned char)pending[0];
+    return true;
+}
 
-    T_MEASURE("IL strip", assembly_strip(assembly_paths, output_path));
+// Generates a runtime object to ship in the lib directory (see the Makefile),
+// the same way incremental builds would, along with its cache key.
+static int
+runtime_object_main(int argc, char **argv)
+{
+    if (argc != 5 || strncmp(argv[2], "-O", 2) != 0 || argv[2][2] < '0'
+            || argv[2][2] > '3' || argv[2][3] != '\0') {
+        ERROR("Usage: %s --runtime-object -On <runtime.bc> <output>\n",
+                argv[0]);
+    }
+    auto opt = (llvm::CodeGenOpt::Level)(argv[2][2] - '0');
+    std::string bitcode_path = argv[3];
+    std::string wasm_path = argv[4];
 
-    T_MEASURE("JS gen", js_gen(assembly_paths, output_path));
+    wasm_target_init();
 
-#undef T_MEASURE
+    std::string error;
+    auto key = wasm_codegen_key(bitcode_path, opt, error);
+    if (key.empty() || !bitcode_codegen(bitcode_path, opt, wasm_path, error)) {
+        ERROR("%s\n", error.c_str());
+    }
+
+    auto key_path = wasm_path + ".key";
+    FILE *key_file = fopen(key_path.c_str(), "w");
+    if (key_file == NULL) {
+        ERROR("can't open `%s': %s\n", key_path.c_str(), strerror(errno));
+    }
+    fprintf(key_file, "%s\n", key.c_str());
+    fclose(key_file);
 
     return 0;
 }
+
+int
+main(int argc, char **argv)
+{
+    if (argc >= 2 && strcmp(argv[1], "--server") == 0) {
+        return server_main(argc, argv);
+    }
+    if (argc >= 2 && strcmp(argv[1], "--runtime-object") == 0) {
+        return runtime_object_main(argc, argv);
+    }
+
+    const char *server_socket = getenv("MONO_WASM_SERVER");
+    if (server_socket != NULL) {
+        int status = 0;
+        if (server_client_run(server_socket, argc, argv, status)) {
+            return status;
+        }
+    }
+
+    return driver_main(argc, argv);
+}
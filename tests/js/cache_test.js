@@ -0,0 +1,136 @@
+// The cache of the compiled code and of the files (see cache_load() and
+// cache_store()), on a stand-in storage object instead of IndexedDB.
+
+var assert = require('assert')
+var index_js = require('./index_js.js')
+
+var context = index_js.load({
+  files: ['mscorlib.dll', 'hello.exe', 'lazy.dll'],
+  files_manifest: {
+    'mscorlib.dll': { size: 3, hash: 'h1', eager: true },
+    'hello.exe': { size: 2, hash: 'h2', eager: true },
+    'lazy.dll': { size: 1, hash: 'h3', eager: false },
+  },
+  files_hash: 'hash-1',
+  mono_wasm_cache: true,
+})
+
+// An empty module.
+var wasm_bytes = new Uint8Array([0x00, 0x61, 0x73, 0x6d, 1, 0, 0, 0])
+
+// Keeps clones of the values, like IndexedDB does. Can be made to refuse
+// compiled modules, like most browsers do.
+function storage(keep_modules) {
+  var entries = new Map()
+  return {
+    entries: entries,
+    get: function(key) {
+      return Promise.resolve(entries.has(key)
+                             ? structuredClone(entries.get(key)) : undefined)
+    },
+    put: function(key, value) {
+      if (!keep_modules && value.module instanceof WebAssembly.Module) {
+        return Promise.reject(new Error('DataCloneError'))
+      }
+      entries.set(key, value.module instanceof WebAssembly.Module
+                  ? value : structuredClone(value))
+      return Promise.resolve()
+    },
+  }
+}
+
+function reset() {
+  context.files_content = {}
+  context.instance = undefined
+}
+
+function loaded_files() {
+  return Object.keys(context.files_content).sort()
+}
+
+var tests = []
+
+tests.push(['cache_open() returns the storage object the page set', function() {
+  var cache = storage(true)
+  context.mono_wasm_cache = cache
+  return context.cache_open().then(function(c) {
+    context.mono_wasm_cache = true
+    assert.strictEqual(c, cache)
+  })
+}])
+
+tests.push(['the compiled module and the loaded files round trip', function() {
+  var cache = storage(true)
+  var module = new WebAssembly.Module(wasm_bytes)
+  reset()
+  context.file_loaded('mscorlib.dll', new Uint8Array([1, 2, 3]))
+  context.file_loaded('hello.exe', new Uint8Array([4, 5]))
+  return context.cache_store(cache, module).then(function() {
+    assert.strictEqual(cache.entries.size, 1)
+    reset()
+    return context.cache_load(cache)
+  }).then(function(loaded) {
+    assert.strictEqual(loaded, true)
+    assert.ok(context.instance instanceof WebAssembly.Instance)
+    assert.deepStrictEqual(loaded_files(), ['hello.exe', 'mscorlib.dll'])
+    assert.deepStrictEqual(Array.from(context.files_content['mscorlib.dll']),
+                           [1, 2, 3])
+  })
+}])
+
+tests.push(['the index.wasm bytes are kept when modules can\'t be', function() {
+  var cache = storage(false)
+  var fetched = []
+  context.fetch_buffer = function(url) {
+    fetched.push(url)
+    return Promise.resolve(wasm_bytes.slice().buffer)
+  }
+  reset()
+  context.file_loaded('mscorlib.dll', new Uint8Array([1, 2, 3]))
+  return context.cache_store(cache, new WebAssembly.Module(wasm_bytes))
+    .then(function() {
+      assert.deepStrictEqual(fetched, ['index.wasm'])
+      reset()
+      return context.cache_load(cache)
+    }).then(function(loaded) {
+      assert.strictEqual(loaded, true)
+      assert.ok(context.instance instanceof WebAssembly.Instance)
+      assert.deepStrictEqual(loaded_files(), ['mscorlib.dll'])
+    })
+}])
+
+tests.push(['an entry for other files is ignored', function() {
+  var cache = storage(true)
+  reset()
+  context.file_loaded('mscorlib.dll', new Uint8Array([1, 2, 3]))
+  return context.cache_store(cache, new WebAssembly.Module(wasm_bytes))
+    .then(function() {
+      reset()
+      context.files_hash = 'hash-2'
+      return context.cache_load(cache)
+    }).then(function(loaded) {
+      context.files_hash = 'hash-1'
+      assert.strictEqual(loaded, false)
+      assert.strictEqual(context.instance, undefined)
+      assert.deepStrictEqual(loaded_files(), [])
+    })
+}])
+
+tests.push(['a cached file whose hash changed isn\'t loaded', function() {
+  var cache = storage(true)
+  reset()
+  context.file_loaded('mscorlib.dll', new Uint8Array([1, 2, 3]))
+  context.file_loaded('hello.exe', new Uint8Array([4, 5]))
+  return context.cache_store(cache, new WebAssembly.Module(wasm_bytes))
+    .then(function() {
+      reset()
+      context.files_manifest['hello.exe'].hash = 'h2-changed'
+      return context.cache_load(cache)
+    }).then(function(loaded) {
+      context.files_manifest['hello.exe'].hash = 'h2'
+      assert.strictEqual(loaded, true)
+      assert.deepStrictEqual(loaded_files(), ['mscorlib.dll'])
+    })
+}])
+
+index_js.run_tests(tests)
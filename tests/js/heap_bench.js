@@ -0,0 +1,66 @@
+// Heap accessors (heap_get_int() and co.), against the byte-wise versions
+// index.js had before, on what argument marshalling and syscalls do: reading
+// and writing many 16, 32 and 64-bit values, a few of them unaligned.
+
+var index_js = require('./index_js.js')
+
+var context = index_js.load()
+index_js.heap_instance(context, 1 << 20)
+
+var old = {
+  heap_get_short: function(ptr) {
+    var heap = context.heap
+    return heap[ptr] + (heap[ptr + 1] << 8)
+  },
+  heap_get_int: function(ptr) {
+    var heap = context.heap
+    return heap[ptr] + (heap[ptr + 1] << 8) + (heap[ptr + 2] << 16)
+      + (heap[ptr + 3] << 24)
+  },
+  heap_get_long: function(ptr) {
+    // Wrong past 32 bits, but as fast as the old one.
+    var heap = context.heap
+    return heap[ptr] + (heap[ptr + 1] << 8) + (heap[ptr + 2] << 16)
+      + (heap[ptr + 3] << 24) + (heap[ptr + 4] << 32) + (heap[ptr + 5] << 40)
+      + (heap[ptr + 6] << 48) + (heap[ptr + 7] << 56)
+  },
+  heap_set_int: function(ptr, d) {
+    var heap = context.heap
+    heap[ptr] = d & 0xff
+    heap[ptr + 1] = (d >> 8) & 0xff
+    heap[ptr + 2] = (d >> 16) & 0xff
+    heap[ptr + 3] = (d >> 24) & 0xff
+    return d
+  },
+}
+
+// 4096 records of 32 bytes: a short, an int, a long, an unaligned int, and
+// an int that is written back.
+var records = 4096
+
+function workload(accessors, records) {
+  var sum = 0
+  for (var i = 0; i < records; i++) {
+    var ptr = 1024 + (i * 32)
+    sum += accessors.heap_get_short(ptr)
+    sum += accessors.heap_get_int(ptr + 4)
+    sum += accessors.heap_get_long(ptr + 8)
+    sum += accessors.heap_get_int(ptr + 17)
+    accessors.heap_set_int(ptr + 24, sum | 0)
+  }
+  return sum
+}
+
+for (var i = 0; i < records * 32; i += 4) {
+  context.heap_set_int(1024 + i, i * 2654435761)
+}
+var current = {}
+for (var name in old) {
+  current[name] = context[name]
+}
+var workload_old = index_js.fresh(workload)
+var workload_current = index_js.fresh(workload)
+var baseline = index_js.bench(function() { workload_old(old, records) })
+index_js.bench_print('heap accessors', baseline, index_js.bench(function() {
+  workload_current(current, records)
+}))
@@ -0,0 +1,40 @@
+// 64-bit heap values (see heap_get_long() and heap_set_long()).
+
+var assert = require('assert')
+var index_js = require('./index_js.js')
+
+var context = index_js.load()
+index_js.heap_instance(context, 1 << 16)
+
+var tests = []
+
+tests.push(['values within 2^53 are numbers', function() {
+  [0, 1, -1, 4294967296, -4294967297, 2 ** 53 - 1, -(2 ** 53)]
+    .forEach(function(value) {
+      context.heap_set_long(9, value)
+      assert.strictEqual(context.heap_get_long(9), value)
+    })
+  context.heap_set_long(16, 2 ** 53 - 1)
+  assert.strictEqual(context.heap_get_ulong(16), 2 ** 53 - 1)
+}])
+
+tests.push(['values past 2^53 are BigInts', function() {
+  [2n ** 53n, -(2n ** 53n) - 1n, 2n ** 63n - 1n, -(2n ** 63n)]
+    .forEach(function(value) {
+      context.heap_set_long(9, value)
+      assert.strictEqual(context.heap_get_long(9), value)
+    })
+  context.heap_set_long(16, 2n ** 64n - 1n)
+  assert.strictEqual(context.heap_get_ulong(16), 2n ** 64n - 1n)
+  assert.strictEqual(context.heap_get_long(16), -1)
+}])
+
+tests.push(['64-bit invoke arguments take BigInts', function() {
+  var setter = context.invoke_arg_setters[context.MONO_TYPE_I8]
+  assert.strictEqual(setter(-(2n ** 60n), 24), 24)
+  assert.strictEqual(context.heap_get_long(24), -(2n ** 60n))
+  setter(-5, 24)
+  assert.strictEqual(context.heap_get_long(24), -5)
+}])
+
+index_js.run_tests(tests)
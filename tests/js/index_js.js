@@ -0,0 +1,93 @@
+// Loads ../../index.js, without the code that starts the program at its end,
+// as the JS shells do: its functions and variables become globals, which
+// tests and benchmarks call on a stand-in `instance' (see heap_instance()).
+
+var fs = require('fs')
+var path = require('path')
+var vm = require('vm')
+
+function load(globals) {
+  var source = fs.readFileSync(path.join(__dirname, '../../index.js'), 'utf8')
+  source = source.substr(0, source.lastIndexOf('\nif (browser_environment) {'))
+
+  global.print = console.log
+  for (var name in globals) {
+    global[name] = globals[name]
+  }
+  vm.runInThisContext(source, { filename: 'index.js' })
+  return global
+}
+
+// Sets up `instance' with a memory of `size' bytes, and a bump allocator as
+// malloc() and memalign(). free() only counts its calls, in `instance.freed'.
+function heap_instance(context, size) {
+  var memory = new WebAssembly.Memory({ initial: Math.ceil(size / 65536) })
+  var next = 8
+  var memalign = function(align, len) {
+    var ptr = Math.ceil(next / align) * align
+    if (ptr + len > memory.buffer.byteLength) {
+      return 0
+    }
+    next = ptr + len
+    return ptr
+  }
+  context.instance = {
+    exports: {
+      memory: memory,
+      malloc: function(len) { return memalign(8, len) },
+      memalign: memalign,
+      free: function(ptr) { context.instance.freed.push(ptr) },
+    },
+    freed: [],
+  }
+  context.heap_update()
+}
+
+// Returns a separately compiled copy of `f', so that the versions being
+// compared don't share the type feedback of its call sites. `f' can only use
+// globals.
+function fresh(f) {
+  return vm.runInThisContext('(' + f.toString() + ')')
+}
+
+function bench_loop(f, ms) {
+  var calls = 0
+  var start = Date.now()
+  var elapsed = 0
+  while ((elapsed = Date.now() - start) < ms) {
+    f()
+    calls++
+  }
+  return calls * 1000 / elapsed
+}
+
+// Runs `f' for about `ms' milliseconds, and returns the number of calls per
+// second.
+function bench(f, ms=500) {
+  return fresh(bench_loop)(f, ms)
+}
+
+function bench_print(name, baseline, rate) {
+  console.log(name + ': ' + rate.toFixed(0) + ' runs/s, '
+              + (rate / baseline).toFixed(2) + 'x the old version')
+}
+
+// Runs the [name, f] tests in sequence, `f' returning a promise or nothing,
+// and exits with a non-zero status if any of them fails.
+function run_tests(tests) {
+  var failures = 0
+  tests.reduce(function(promise, test) {
+    return promise.then(test[1]).then(function() {
+      console.log('ok - ' + test[0])
+    }, function(e) {
+      failures++
+      console.log('not ok - ' + test[0] + ': ' + e.stack)
+    })
+  }, Promise.resolve()).then(function() {
+    process.exitCode = failures > 0 ? 1 : 0
+  })
+}
+
+module.exports = { load: load, heap_instance: heap_instance, fresh: fresh,
+                   bench: bench, bench_print: bench_print,
+                   run_tests: run_tests }
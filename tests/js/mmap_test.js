@@ -0,0 +1,128 @@
+// mmap() and munmap(), of files and anonymous, on a stand-in instance whose
+// malloc() and memalign() hand out memory from a bump allocator.
+
+var assert = require('assert')
+var index_js = require('./index_js.js')
+
+var context = index_js.load({
+  files: ['mscorlib.dll', 'lazy.dll'],
+  files_manifest: {
+    'mscorlib.dll': { size: 5, hash: 'h1', eager: true },
+    'lazy.dll': { size: 1, hash: 'h2', eager: false },
+  },
+})
+index_js.heap_instance(context, 16 << 20)
+
+var fetched = []
+context.fetch_buffer = function(url) {
+  fetched.push(url)
+  return Promise.resolve(new Uint8Array([9]).buffer)
+}
+
+function open(name) {
+  var content = context.file_content(name)
+  context.fds[3] = { path: name, offset: 0, content: content }
+  return 3
+}
+
+var tests = []
+
+tests.push(['a file mapped as a whole isn\'t downloaded again', function() {
+  context.file_loaded('mscorlib.dll', new Uint8Array([1, 2, 3, 4, 5]))
+  var addr = context.mmap(0, 5, 1, 2, open('mscorlib.dll'), 0)
+  context.fds[3] = undefined
+  assert.strictEqual(context.files_content['mscorlib.dll'], undefined)
+  assert.deepStrictEqual(Array.from(context.heap.subarray(addr, addr + 5)),
+                         [1, 2, 3, 4, 5])
+
+  context.files_prefetch(function() { return false })
+  return new Promise(setImmediate).then(function() {
+    assert.deepStrictEqual(fetched, ['lazy.dll'])
+    assert.deepStrictEqual(Array.from(context.files_content['lazy.dll']), [9])
+  })
+}])
+
+tests.push(['a mapped file opened again is copied from its mapping', function() {
+  var addr = context.mmap_keys['mscorlib.dll:0:5']
+  var content = context.file_content('mscorlib.dll')
+  assert.deepStrictEqual(Array.from(content), [1, 2, 3, 4, 5])
+  assert.deepStrictEqual(fetched, ['lazy.dll'])
+
+  // Mapped again, it shares the mapping and drops the copy.
+  assert.strictEqual(context.mmap(0, 5, 1, 2, open('mscorlib.dll'), 0), addr)
+  context.fds[3] = undefined
+  assert.strictEqual(context.files_content['mscorlib.dll'], undefined)
+
+  context.munmap(addr, 5)
+  assert.ok(context.file_is_available('mscorlib.dll'))
+  context.munmap(addr, 5)
+  assert.ok(!context.file_is_available('mscorlib.dll'))
+}])
+
+var MAP_ANONYMOUS = 0x20
+var page = 65536
+
+function mmap_anon(len) {
+  return context.mmap(0, len, 3, 0x02 | MAP_ANONYMOUS, -1, 0)
+}
+
+function freed() {
+  return context.instance.freed.splice(0)
+}
+
+tests.push(['an anonymous region is freed once all of it is unmapped',
+            function() {
+  freed()
+  var addr = mmap_anon(4 * page)
+  context.munmap(addr, page)
+  context.munmap(addr, page) // twice
+  context.munmap(addr + (3 * page), page)
+  assert.deepStrictEqual(freed(), [])
+  assert.strictEqual(context.mmap_anon_find(addr).unmapped.length, 2)
+  context.munmap(addr + page, 2 * page)
+  assert.deepStrictEqual(freed(), [addr])
+  assert.strictEqual(context.mmap_anon_find(addr), undefined)
+}])
+
+tests.push(['the head and tail of an aligned mapping are reused', function() {
+  freed()
+  // What the GC does to get a mapping aligned on 4 pages.
+  var addr = mmap_anon(6 * page)
+  var aligned = Math.ceil((addr + 1) / (4 * page)) * (4 * page)
+  if (aligned > addr) {
+    context.munmap(addr, aligned - addr)
+  }
+  var tail = addr + (6 * page) - aligned - (4 * page)
+  if (tail > 0) {
+    context.munmap(aligned + (4 * page), tail)
+  }
+
+  var bytes = context.memory_stats.mmap_bytes
+  var head = mmap_anon(page)
+  assert.ok(head >= addr && head < addr + (6 * page))
+  assert.ok(head < aligned || head >= aligned + (4 * page))
+  assert.ok(context.heap.subarray(head, head + page).every(function(b) {
+    return b == 0
+  }))
+  assert.strictEqual(context.memory_stats.mmap_bytes, bytes + page)
+
+  context.munmap(aligned, 4 * page)
+  context.munmap(head, page)
+  assert.deepStrictEqual(freed(), [addr])
+}])
+
+tests.push(['memalign() mapping memory itself fails that mapping', function() {
+  var memalign = context.instance.exports.memalign
+  var inner = undefined
+  context.instance.exports.memalign = function(align, len) {
+    inner = mmap_anon(len)
+    return memalign(align, len)
+  }
+  var addr = mmap_anon(page)
+  context.instance.exports.memalign = memalign
+  assert.strictEqual(inner, context.MAP_FAILED)
+  assert.notStrictEqual(addr, context.MAP_FAILED)
+  context.munmap(addr, page)
+}])
+
+index_js.run_tests(tests)
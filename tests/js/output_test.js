@@ -0,0 +1,84 @@
+// Program output on stdout and stderr (see out_buffer_add()).
+
+var assert = require('assert')
+var index_js = require('./index_js.js')
+
+var context = index_js.load()
+index_js.heap_instance(context, 1 << 20)
+
+var output = []
+context.mono_wasm_output = function(fd, text) {
+  output.push(fd + ': ' + text)
+}
+var logs = []
+context.log = function(str) {
+  logs.push(str)
+}
+
+function write(fd, str) {
+  var bytes = Buffer.from(str)
+  context.heap.set(bytes, 1024)
+  context.out_buffer_add(fd, 1024, bytes.length)
+}
+
+function reset() {
+  context.out_flush_all(true)
+  context.debug_logs = false
+  output = []
+  logs = []
+}
+
+var tests = []
+
+tests.push(['stdout is flushed by complete lines', function() {
+  reset()
+  write(1, 'hello ')
+  write(1, 'world\nand ')
+  context.out_flush_all(false)
+  assert.deepStrictEqual(output, ['1: hello world'])
+  context.out_flush_all(true)
+  assert.deepStrictEqual(output, ['1: hello world', '1: and '])
+}])
+
+tests.push(['stderr is flushed at each complete line', function() {
+  reset()
+  write(2, 'first\nsec')
+  assert.deepStrictEqual(output, ['2: first'])
+  write(2, 'ond\n')
+  assert.deepStrictEqual(output, ['2: first', '2: second'])
+}])
+
+tests.push(['debug messages don\'t cut lines', function() {
+  reset()
+  context.debug_logs = true
+  write(1, 'hello ')
+  context.debug('message')
+  write(1, 'world\n')
+  assert.deepStrictEqual(output, ['1: hello world'])
+  assert.deepStrictEqual(logs, ['>> message'])
+}])
+
+tests.push(['characters cut between writes are decoded whole', function() {
+  reset()
+  var bytes = Buffer.from('été\n')
+  context.heap.set(bytes, 1024)
+  context.out_buffer_add(1, 1024, 1)
+  assert.strictEqual(context.heap_get_string(context.heap_malloc_string('a')),
+                     'a')
+  context.out_buffer_add(1, 1025, bytes.length - 1)
+  context.out_flush_all(false)
+  assert.deepStrictEqual(output, ['1: été'])
+}])
+
+tests.push(['output is only flushed again once more is written', function() {
+  reset()
+  write(1, 'hello\nwor')
+  context.out_flush_all(false)
+  assert.strictEqual(context.out_pending, false)
+  write(1, 'ld\n')
+  assert.strictEqual(context.out_pending, true)
+  context.out_flush_all(false)
+  assert.deepStrictEqual(output, ['1: hello', '1: world'])
+}])
+
+index_js.run_tests(tests)
@@ -0,0 +1,68 @@
+// Syscall dispatch (__syscall3() and co.), against the dispatchers as they
+// were when they passed `arguments' to the trace function, and against the
+// route_syscall() index.js had before, which copied the arguments into an
+// array and called the handler with apply().
+
+var index_js = require('./index_js.js')
+
+var context = index_js.load()
+index_js.heap_instance(context, 1 << 20)
+
+// A cheap handler, so that the dispatch is what is measured.
+context.syscalls[500] = function SYS_bench(a, b, c) {
+  return a + b + c
+}
+
+var syscall3_arguments = index_js.fresh(function(n, a, b, c) {
+  if (debug_logs) syscall_trace(n, arguments)
+  var f = syscalls[n]
+  return f ? f(a, b, c) : syscall_missing(n)
+})
+
+var route_syscall = index_js.fresh(function(n) {
+  var args = [].slice.call(arguments, 1)
+  var f = syscalls[n]
+  return f ? f.apply(null, args) : syscall_missing(n)
+})
+
+// The C library calls the dispatchers from WASM, where V8 can't inline them
+// (and then optimize the arguments object away) as it would in a JS loop.
+// run(count) calls the imported `syscall3' with (500, i, 1, 2), `count'
+// times, and returns the sum of the results.
+var wasm_bytes = new Uint8Array([
+  0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00,
+  // Types: (i32, i32, i32, i32) -> i32, (i32) -> i32.
+  0x01, 0x0e, 0x02,
+  0x60, 0x04, 0x7f, 0x7f, 0x7f, 0x7f, 0x01, 0x7f,
+  0x60, 0x01, 0x7f, 0x01, 0x7f,
+  // Imports: env.syscall3.
+  0x02, 0x10, 0x01, 0x03, 0x65, 0x6e, 0x76,
+  0x08, 0x73, 0x79, 0x73, 0x63, 0x61, 0x6c, 0x6c, 0x33, 0x00, 0x00,
+  // Functions, exports: run.
+  0x03, 0x02, 0x01, 0x01,
+  0x07, 0x07, 0x01, 0x03, 0x72, 0x75, 0x6e, 0x00, 0x01,
+  // Code: locals i and sum.
+  0x0a, 0x27, 0x01, 0x25, 0x01, 0x02, 0x7f,
+  0x03, 0x40,                                     // loop
+  0x41, 0xf4, 0x03, 0x20, 0x01, 0x41, 0x01, 0x41, 0x02,
+  0x10, 0x00,                                     // call syscall3
+  0x20, 0x02, 0x6a, 0x21, 0x02,                   // sum += result
+  0x20, 0x01, 0x41, 0x01, 0x6a, 0x22, 0x01,       // i++
+  0x20, 0x00, 0x48, 0x0d, 0x00,                   // while (i < count)
+  0x0b,
+  0x20, 0x02, 0x0b,
+])
+
+function wasm_run(syscall3) {
+  var module = new WebAssembly.Module(wasm_bytes)
+  var run = new WebAssembly.Instance(module, {
+    env: { syscall3: syscall3 }
+  }).exports.run
+  return function() { run(10000) }
+}
+
+var baseline = index_js.bench(wasm_run(route_syscall))
+index_js.bench_print('syscall dispatch, passing arguments', baseline,
+                     index_js.bench(wasm_run(syscall3_arguments)))
+index_js.bench_print('syscall dispatch', baseline,
+                     index_js.bench(wasm_run(context.syscall3)))
@@ -0,0 +1,85 @@
+// String marshalling on large strings (as DOM-heavy pages pass around):
+// heap_set_string() then heap_get_string() of the same string, and
+// heap_get_mono_string(), against the char-at-a-time versions index.js had
+// before. The text is ASCII, which the old versions handled correctly.
+
+var index_js = require('./index_js.js')
+
+var context = index_js.load()
+index_js.heap_instance(context, 4 << 20)
+
+var old = {
+  heap_get_string: function(ptr) {
+    var heap = context.heap
+    var str = ''
+    for (var i = 0; heap[ptr + i] != 0; i++) {
+      str += String.fromCharCode(heap[ptr + i])
+    }
+    return str
+  },
+  heap_set_string: function(ptr, str) {
+    var heap = context.heap
+    for (var i = 0; i < str.length; i++) {
+      heap[ptr + i] = str.charCodeAt(i)
+    }
+    heap[ptr + str.length] = 0
+  },
+  heap_get_mono_string: function(ptr) {
+    var heap = context.heap
+    var length = context.heap_get_int(ptr + 8)
+    var str = ''
+    for (var i = 0; i < length; i++) {
+      var p = ptr + 12 + (i * 2)
+      str += String.fromCharCode(heap[p] + (heap[p + 1] << 8))
+    }
+    return str
+  },
+}
+
+var text = ''
+while (text.length < 256 * 1024) {
+  text += '<div class="row" id="item-' + text.length + '">Hello, world</div>\n'
+}
+
+// A MonoString: its length at offset 8, then its UTF-16 characters.
+var mono_string = 1 << 20
+context.heap_set_int(mono_string + 8, text.length)
+for (var i = 0; i < text.length; i++) {
+  context.heap_u16[((mono_string + 12) >> 1) + i] = text.charCodeAt(i)
+}
+
+function round_trip(accessors, text) {
+  accessors.heap_set_string(64, text)
+  if (accessors.heap_get_string(64) != text) {
+    throw new Error('UTF-8 round trip failed')
+  }
+}
+
+function mono_string_get(accessors, ptr, text) {
+  if (accessors.heap_get_mono_string(ptr) != text) {
+    throw new Error('MonoString decoding failed')
+  }
+}
+
+var current = {}
+for (var name in old) {
+  current[name] = context[name]
+}
+
+var round_trip_old = index_js.fresh(round_trip)
+var round_trip_current = index_js.fresh(round_trip)
+var baseline = index_js.bench(function() { round_trip_old(old, text) })
+index_js.bench_print('UTF-8 round trip (256K)', baseline,
+                     index_js.bench(function() {
+                       round_trip_current(current, text)
+                     }))
+
+var mono_string_get_old = index_js.fresh(mono_string_get)
+var mono_string_get_current = index_js.fresh(mono_string_get)
+baseline = index_js.bench(function() {
+  mono_string_get_old(old, mono_string, text)
+})
+index_js.bench_print('MonoString decoding (256K)', baseline,
+                     index_js.bench(function() {
+                       mono_string_get_current(current, mono_string, text)
+                     }))